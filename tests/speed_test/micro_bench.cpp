@@ -0,0 +1,336 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <random>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "../../youtokentome/cpp/bpe.h"
+
+std::atomic<uint64_t> n_allocations(0);
+
+void *operator new(size_t size) {
+  n_allocations++;
+  void *ptr = malloc(size);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept {
+  free(ptr);
+}
+
+namespace vkcom {
+
+using namespace std;
+
+const string MODEL_PATH = "micro_bench_model.yttm";
+const string TRAIN_PATH = "micro_bench_train.txt";
+
+// Words are drawn from a Zipf-like distribution, as in natural text.
+vector<string> generate_sentences(int n_sentences, int n_words, mt19937 &rnd) {
+  const string alphabet = "abcdefghijklmnopqrstuvwxyz";
+  vector<string> words;
+  for (int i = 0; i < n_words; i++) {
+    string word;
+    int len = 1 + rnd() % 10;
+    for (int j = 0; j < len; j++) {
+      word.push_back(alphabet[rnd() % alphabet.size()]);
+    }
+    words.push_back(word);
+  }
+  vector<double> weights;
+  for (uint64_t i = 0; i < words.size(); i++) {
+    weights.push_back(1.0 / (i + 1));
+  }
+  discrete_distribution<int> word_dist(weights.begin(), weights.end());
+
+  vector<string> sentences;
+  for (int i = 0; i < n_sentences; i++) {
+    string sentence;
+    int n_words = 5 + rnd() % 30;
+    for (int j = 0; j < n_words; j++) {
+      sentence += words[word_dist(rnd)] + " ";
+    }
+    sentences.push_back(sentence);
+  }
+  return sentences;
+}
+
+void train_model(const vector<string> &sentences, int vocab_size) {
+  FILE *fout = fopen(TRAIN_PATH.c_str(), "w");
+  for (const auto &sentence : sentences) {
+    fprintf(fout, "%s\n", sentence.c_str());
+  }
+  fclose(fout);
+  Status status = train_bpe(TRAIN_PATH, MODEL_PATH, vocab_size, BpeConfig(1.0, 1, {0, 1, 2, 3}));
+  if (!status.ok()) {
+    cerr << status.error_message() << endl;
+    exit(1);
+  }
+  remove(TRAIN_PATH.c_str());
+}
+
+BaseEncoder load_model(int n_threads, const EncoderConfig &config) {
+  Status status;
+  BaseEncoder encoder(MODEL_PATH, n_threads, &status, config);
+  if (!status.ok()) {
+    cerr << status.error_message() << endl;
+    exit(1);
+  }
+  return encoder;
+}
+
+double seconds_since(chrono::steady_clock::time_point start) {
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Encodes the same batch into the same output several times and counts heap
+// allocations made after the warm-up. Returns the number of allocations.
+uint64_t allocations_bench(const string &name, const BaseEncoder &encoder,
+                           const vector<string> &sentences, int n_iter) {
+  vector<vector<int>> ids;
+  for (int i = 0; i < 2; i++) {
+    encoder.encode_as_ids(sentences, &ids);
+  }
+  uint64_t allocations_before = n_allocations;
+  auto start = chrono::steady_clock::now();
+  for (int i = 0; i < n_iter; i++) {
+    encoder.encode_as_ids(sentences, &ids);
+  }
+  double elapsed = seconds_since(start);
+  uint64_t allocations = n_allocations - allocations_before;
+  printf("%-22s allocations per batch: %-8.1f sentences per second: %.0f\n", name.c_str(),
+         static_cast<double>(allocations) / n_iter, sentences.size() * n_iter / elapsed);
+  return allocations;
+}
+
+int alloc_bench() {
+  mt19937 rnd(17);
+  train_model(generate_sentences(20000, 5000, rnd), 5000);
+  auto sentences = generate_sentences(2000, 5000, rnd);
+  const int n_iter = 20;
+
+  uint64_t allocations = 0;
+  allocations += allocations_bench("encode", load_model(1, EncoderConfig()), sentences, n_iter);
+  allocations += allocations_bench("encode (word cache)", load_model(1, EncoderConfig(1 << 24)),
+                                   sentences, n_iter);
+  EncoderConfig backtracking_config;
+  backtracking_config.engine = BACKTRACKING;
+  allocations += allocations_bench("encode (backtracking)", load_model(1, backtracking_config),
+                                   sentences, n_iter);
+
+  // Decoding of a sentence into a string with enough capacity
+  BaseEncoder encoder = load_model(1, EncoderConfig());
+  vector<vector<int>> ids;
+  encoder.encode_as_ids(sentences, &ids);
+  unordered_set<int> ignore_ids = {0, 1};
+  string decoded;
+  decoded.reserve(1 << 20);
+  uint64_t allocations_before = n_allocations;
+  for (int i = 0; i < n_iter; i++) {
+    for (const auto &sentence_ids : ids) {
+      decoded.clear();
+      encoder.decode(sentence_ids, &decoded, &ignore_ids);
+    }
+  }
+  uint64_t decode_allocations = n_allocations - allocations_before;
+  printf("%-22s allocations per batch: %.1f\n", "decode",
+         static_cast<double>(decode_allocations) / n_iter);
+  allocations += decode_allocations;
+  remove(MODEL_PATH.c_str());
+  return allocations == 0 ? 0 : 1;
+}
+
+template<typename Lookup>
+void lookup_bench(const string &name, const vector<pair<uint32_t, uint32_t>> &queries,
+                  int n_iter, const Lookup &lookup) {
+  int64_t checksum = 0;
+  auto start = chrono::steady_clock::now();
+  for (int i = 0; i < n_iter; i++) {
+    for (const auto &query : queries) {
+      checksum += lookup(query.first, query.second);
+    }
+  }
+  double elapsed = seconds_since(start);
+  printf("%-32s ns per lookup: %-8.2f checksum: %lld\n", name.c_str(),
+         elapsed * 1e9 / (static_cast<double>(queries.size()) * n_iter),
+         static_cast<long long>(checksum));
+}
+
+// Compares RuleTable against a hash map from the pair of tokens to the rule id.
+int rules_bench() {
+  mt19937 rnd(17);
+  train_model(generate_sentences(50000, 50000, rnd), 30000);
+  BaseEncoder encoder = load_model(1, EncoderConfig());
+  remove(MODEL_PATH.c_str());
+  const auto &rules = encoder.bpe_state.rules;
+
+  flat_hash_map<uint64_t, int> rule2id;
+  for (int i = 0; i < (int) rules.size(); i++) {
+    rule2id[(static_cast<uint64_t>(rules[i].x) << 32u) + rules[i].y] = i;
+  }
+  auto map_lookup = [&](uint32_t x, uint32_t y) {
+    auto it = rule2id.find((static_cast<uint64_t>(x) << 32u) + y);
+    return it == rule2id.end() ? -1 : it->second;
+  };
+  auto table_lookup = [&](uint32_t x, uint32_t y) {
+    return encoder.rule_table.find(x, y);
+  };
+
+  // Pairs of adjacent characters are looked up when encoding starts,
+  // pairs of merged tokens after merges, and most random pairs have no rule.
+  vector<pair<string, vector<pair<uint32_t, uint32_t>>>> workloads(3);
+  workloads[0].first = "adjacent characters";
+  for (const auto &sentence : generate_sentences(2000, 50000, rnd)) {
+    for (uint64_t i = 0; i + 1 < sentence.size(); i++) {
+      if (sentence[i] != ' ' && sentence[i + 1] != ' ') {
+        workloads[0].second.emplace_back(encoder.bpe_state.char2id.at(sentence[i]),
+                                         encoder.bpe_state.char2id.at(sentence[i + 1]));
+      }
+    }
+  }
+  workloads[1].first = "merge rules";
+  for (const auto &rule : rules) {
+    workloads[1].second.emplace_back(rule.x, rule.y);
+  }
+  shuffle(workloads[1].second.begin(), workloads[1].second.end(), rnd);
+  workloads[2].first = "random pairs";
+  for (uint64_t i = 0; i < rules.size(); i++) {
+    workloads[2].second.emplace_back(rnd() % encoder.vocab_size(), rnd() % encoder.vocab_size());
+  }
+
+  printf("rules: %d  RuleTable memory: %llu bytes\n", (int) rules.size(),
+         static_cast<unsigned long long>(encoder.rule_table.memory()));
+  for (const auto &workload : workloads) {
+    for (const auto &query : workload.second) {
+      if (map_lookup(query.first, query.second) != table_lookup(query.first, query.second)) {
+        cerr << "RuleTable differs from the hash map" << endl;
+        return 1;
+      }
+    }
+    int n_iter = max<int>(1, 20000000 / workload.second.size());
+    lookup_bench(workload.first + ", hash map", workload.second, n_iter, map_lookup);
+    lookup_bench(workload.first + ", RuleTable", workload.second, n_iter, table_lookup);
+  }
+  return 0;
+}
+
+double encode_bench(const string &name, const BaseEncoder &encoder,
+                    const vector<string> &sentences, int n_iter, vector<vector<int>> *ids) {
+  auto start = chrono::steady_clock::now();
+  for (int i = 0; i < n_iter; i++) {
+    encoder.encode_as_ids(sentences, ids);
+  }
+  double elapsed = seconds_since(start);
+  uint64_t n_bytes = 0;
+  for (const auto &sentence : sentences) {
+    n_bytes += sentence.size();
+  }
+  printf("%-40s MB per second: %.2f\n", name.c_str(), n_bytes * n_iter / elapsed / 1e6);
+  return elapsed;
+}
+
+// Compares the encoding engines on ordinary text and on text without spaces,
+// where the whole sentence is a single long word.
+int engines_bench() {
+  mt19937 rnd(17);
+  train_model(generate_sentences(50000, 50000, rnd), 30000);
+  EncoderConfig backtracking_config;
+  backtracking_config.engine = BACKTRACKING;
+  BaseEncoder priority_queue = load_model(1, EncoderConfig());
+  BaseEncoder backtracking = load_model(1, backtracking_config);
+  remove(MODEL_PATH.c_str());
+  if (backtracking.encoding_engine() != BACKTRACKING) {
+    cerr << "the model can't be encoded by backtracking" << endl;
+    return 1;
+  }
+
+  auto sentences = generate_sentences(2000, 50000, rnd);
+  for (int word_len : {0, 100, 1000, 10000}) {
+    vector<string> text = sentences;
+    string name = "words";
+    if (word_len != 0) {
+      string all_text;
+      for (const auto &sentence : sentences) {
+        for (char ch : sentence) {
+          if (ch != ' ') {
+            all_text.push_back(ch);
+          }
+        }
+      }
+      text.clear();
+      for (uint64_t i = 0; i + word_len <= all_text.size(); i += word_len) {
+        text.push_back(all_text.substr(i, word_len));
+      }
+      name = "words of " + to_string(word_len) + " characters";
+    }
+    vector<vector<int>> expected, ids;
+    encode_bench(name + ", priority queue", priority_queue, text, 5, &expected);
+    encode_bench(name + ", backtracking", backtracking, text, 5, &ids);
+    if (ids != expected) {
+      cerr << "engines give different results" << endl;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Throughput of batched decoding, with and without ignored ids.
+int decode_bench() {
+  mt19937 rnd(17);
+  train_model(generate_sentences(50000, 50000, rnd), 30000);
+  auto sentences = generate_sentences(20000, 50000, rnd);
+  for (int n_threads : {1, 4}) {
+    BaseEncoder encoder = load_model(n_threads, EncoderConfig());
+    vector<vector<int>> ids;
+    encoder.encode_as_ids(sentences, &ids);
+    uint64_t n_ids = 0;
+    for (const auto &sentence_ids : ids) {
+      n_ids += sentence_ids.size();
+    }
+    for (bool ignore : {false, true}) {
+      unordered_set<int> ignore_ids;
+      if (ignore) {
+        ignore_ids = {0, 1, 2, 3};
+      }
+      const int n_iter = 10;
+      auto start = chrono::steady_clock::now();
+      for (int i = 0; i < n_iter; i++) {
+        vector<string> decoded;
+        encoder.decode(ids, &decoded, &ignore_ids);
+      }
+      double elapsed = seconds_since(start);
+      string name = "decode, " + to_string(n_threads) + " threads" + (ignore ? ", ignore_ids" : "");
+      printf("%-40s M ids per second: %.2f\n", name.c_str(), n_ids * n_iter / elapsed / 1e6);
+    }
+  }
+  remove(MODEL_PATH.c_str());
+  return 0;
+}
+
+}  // namespace vkcom
+
+int main(int argc, char **argv) {
+  if (argc == 2 && std::string(argv[1]) == "alloc") {
+    return vkcom::alloc_bench();
+  }
+  if (argc == 2 && std::string(argv[1]) == "rules") {
+    return vkcom::rules_bench();
+  }
+  if (argc == 2 && std::string(argv[1]) == "engines") {
+    return vkcom::engines_bench();
+  }
+  if (argc == 2 && std::string(argv[1]) == "decode") {
+    return vkcom::decode_bench();
+  }
+  std::cerr << "usage: " << argv[0] << " alloc|rules|engines|decode" << std::endl;
+  return 1;
+}
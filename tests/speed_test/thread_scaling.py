@@ -0,0 +1,88 @@
+import argparse
+import random
+import tempfile
+from concurrent.futures import ThreadPoolExecutor
+from pathlib import Path
+from time import time
+
+import youtokentome as yttm
+
+
+def generate_text(n_lines, n_words, rnd):
+    alphabet = "abcdefghijklmnopqrstuvwxyz"
+    lines = []
+    for _ in range(n_lines):
+        words = [
+            "".join(rnd.choice(alphabet) for _ in range(rnd.randint(1, 10)))
+            for _ in range(n_words)
+        ]
+        lines.append(" ".join(words))
+    return lines
+
+
+def measure(bpe, batches, n_callers, call):
+    start = time()
+    with ThreadPoolExecutor(max_workers=n_callers) as executor:
+        list(executor.map(call, [bpe] * len(batches), batches))
+    return time() - start
+
+
+def encode_ids(bpe, batch):
+    bpe.encode(batch)
+
+
+def encode_dropout(bpe, batch):
+    bpe.encode(batch, dropout_prob=0.1, dropout_seed=1)
+
+
+def decode(bpe, batch):
+    bpe.decode(batch)
+
+
+def main(args):
+    rnd = random.Random(0)
+    with tempfile.TemporaryDirectory() as tmp_dir:
+        train_path = Path(tmp_dir) / "train.txt"
+        model_path = Path(tmp_dir) / "bpe.model"
+        train_path.write_text("\n".join(generate_text(20000, 20, rnd)))
+        yttm.BPE.train(
+            data=str(train_path), vocab_size=args.vocab_size, model=str(model_path)
+        )
+        # Every call of the benchmark is single-threaded inside the encoder,
+        # so the speedup comes only from calls running at the same time.
+        bpe = yttm.BPE(str(model_path), n_threads=1)
+
+    text = generate_text(args.n_batches * args.batch_size, 20, rnd)
+    batches = [
+        text[i : i + args.batch_size] for i in range(0, len(text), args.batch_size)
+    ]
+    id_batches = [bpe.encode(batch) for batch in batches]
+
+    for name, call, inputs in [
+        ("encode", encode_ids, batches),
+        ("encode with dropout", encode_dropout, batches),
+        ("decode", decode, id_batches),
+    ]:
+        base = None
+        for n_callers in args.n_callers:
+            elapsed = measure(bpe, inputs, n_callers, call)
+            base = base or elapsed
+            print(
+                "{:20} callers: {:2}  {:8.0f} sentences/s  speedup: {:.2f}".format(
+                    name, n_callers, len(text) / elapsed, base / elapsed
+                )
+            )
+
+
+def parse_args():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--vocab_size", type=int, default=10000)
+    parser.add_argument("--batch_size", type=int, default=1000)
+    parser.add_argument("--n_batches", type=int, default=64)
+    parser.add_argument("--n_callers", type=int, nargs="+", default=[1, 2, 4, 8])
+    return parser.parse_args()
+
+
+if __name__ == "__main__":
+    args = parse_args()
+    main(args)
@@ -4,7 +4,11 @@
 #include <iostream>
 #include <cassert>
 #include <algorithm>
+#include <cstring>
+#include <fstream>
 #include <random>
+#include <sstream>
+#include <thread>
 #include "stress_test.h"
 
 #include "../../youtokentome/cpp/utils.h"
@@ -195,9 +199,15 @@ BPEState learn_bpe_slow(const string &text_utf8, int n_token, string, BpeConfig
 DecodeResult decode_slow(const string &text_utf8, const BaseEncoder &bpe_applyer) {
 
   const auto &char2id = bpe_applyer.bpe_state.char2id;
-  const auto &id2char = bpe_applyer.id2char;
   const auto &rules = bpe_applyer.bpe_state.rules;
-  const auto &recipe = bpe_applyer.recipe;
+  map<uint32_t, vector<uint32_t>> recipe;
+  for (auto x: char2id) {
+    recipe[x.second] = {x.first};
+  }
+  for (auto rule: rules) {
+    recipe[rule.z] = recipe[rule.x];
+    recipe[rule.z].insert(recipe[rule.z].end(), recipe[rule.y].begin(), recipe[rule.y].end());
+  }
 
   auto text = decode_utf8(text_utf8.data(), text_utf8.data() + text_utf8.size());
   for (auto &ch: text) {
@@ -255,13 +265,7 @@ DecodeResult decode_slow(const string &text_utf8, const BaseEncoder &bpe_applyer
       if (static_cast<long long>(u.val) == bpe_applyer.bpe_state.special_tokens.unk_id) {
         pieces.push_back(u.new_chars);
       } else {
-        auto recipe_u = recipe.at(u.val);
-        vector<uint32_t> recipe_u_utf8;
-        for (auto ch: recipe_u) {
-          assert(id2char.count(ch));
-          recipe_u_utf8.push_back(id2char.at(ch));
-        }
-        pieces.push_back(encode_utf8(recipe_u_utf8));
+        pieces.push_back(encode_utf8(recipe.at(u.val)));
       }
     }
   }
@@ -348,6 +352,53 @@ vector<uint32_t> to_no_space_tokens(string raw_string) {
   return tokens;
 }
 
+// Row of encode_as_ids_fixed built from the result of encode_as_ids.
+vector<int> fixed_row_slow(vector<int> ids, uint64_t max_len, bool truncate_left, bool bos, bool eos,
+                           bool reverse, int pad_id) {
+  if (reverse) {
+    std::reverse(ids.begin(), ids.end());
+  }
+  uint64_t n_special = bos + eos;
+  uint64_t n_tokens = min<uint64_t>(ids.size() - n_special, max_len - n_special);
+  vector<int> row;
+  if (bos) {
+    row.push_back(ids[0]);
+  }
+  auto first = truncate_left ? ids.end() - eos - n_tokens : ids.begin() + bos;
+  row.insert(row.end(), first, first + n_tokens);
+  if (eos) {
+    row.push_back(ids.back());
+  }
+  if (reverse) {
+    std::reverse(row.begin(), row.end());
+  }
+  row.resize(max_len, pad_id);
+  return row;
+}
+
+void fixed_test(const BaseEncoder &applyer, const vector<string> &sentences, mt19937 &rnd) {
+  bool bos = uniform_dist_int(rnd, 0, 2);
+  bool eos = uniform_dist_int(rnd, 0, 2);
+  bool reverse = uniform_dist_int(rnd, 0, 2);
+  bool truncate_left = uniform_dist_int(rnd, 0, 2);
+  double dropout_prob = uniform_dist_int(rnd, 0, 2) * 0.3;
+  uint64_t max_len = uniform_dist_int(rnd, bos + eos, 40);
+  vector<vector<int>> ids;
+  Status status = applyer.encode_as_ids(sentences, &ids, bos, eos, reverse, dropout_prob, 5);
+  assert(status.ok());
+  vector<int> matrix(sentences.size() * max_len, -1);
+  vector<uint64_t> lengths(sentences.size());
+  status = applyer.encode_as_ids_fixed(sentences, max_len, truncate_left, matrix.data(), lengths.data(),
+                                       bos, eos, reverse, dropout_prob, 5);
+  assert(status.ok());
+  for (uint64_t i = 0; i < sentences.size(); i++) {
+    vector<int> row(matrix.begin() + i * max_len, matrix.begin() + (i + 1) * max_len);
+    assert(row == fixed_row_slow(ids[i], max_len, truncate_left, bos, eos, reverse,
+                                 applyer.bpe_state.special_tokens.pad_id));
+    assert(lengths[i] == min<uint64_t>(ids[i].size(), max_len));
+  }
+}
+
 void parallel_test(int n_iter, int n_threads) {
   mt19937 rnd;
   Status status;
@@ -385,7 +436,285 @@ void parallel_test(int n_iter, int n_threads) {
     status = applyer.encode_as_subwords(inference_data, &result_parallel);
     assert(status.ok());
     assert(result_sentence_by_sentence == result_parallel);
+
+    SubwordViews views;
+    status = applyer.encode_as_subword_views(inference_data, &views);
+    assert(status.ok());
+    assert(views.pieces.size() == inference_data.size());
+    for (uint64_t j = 0; j < inference_data.size(); j++) {
+      vector<string> pieces;
+      for (const auto &piece : views.pieces[j]) {
+        pieces.push_back(piece.str());
+      }
+      assert(pieces == result_parallel[j]);
+    }
+
+    vector<vector<int>> ids_parallel;
+    status = applyer.encode_as_ids(inference_data, &ids_parallel, true, true);
+    assert(status.ok());
+    vector<int> ids_flat;
+    vector<uint64_t> offsets;
+    status = applyer.encode_as_ids_flat(inference_data, &ids_flat, &offsets, true, true);
+    assert(status.ok());
+    assert(offsets.size() == inference_data.size() + 1);
+    for (uint64_t j = 0; j < inference_data.size(); j++) {
+      assert(vector<int>(ids_flat.begin() + offsets[j], ids_flat.begin() + offsets[j + 1]) == ids_parallel[j]);
+    }
+    assert(offsets.back() == ids_flat.size());
+
+    // Sentences read in place from one buffer with offsets, which don't start at zero as in
+    // a slice of an Arrow column, and from an array of views.
+    string joined = "prefix";
+    vector<uint64_t> joined_offsets = {joined.size()};
+    for (const auto &sentence : inference_data) {
+      joined += sentence;
+      joined_offsets.push_back(joined.size());
+    }
+    vector<SentenceView> views_of_sentences;
+    for (const auto &sentence : inference_data) {
+      views_of_sentences.push_back({sentence.data(), sentence.size()});
+    }
+    for (const SentenceBatch &batch : {SentenceBatch(joined.data(), joined_offsets.data(), inference_data.size()),
+                                       SentenceBatch(views_of_sentences.data(), views_of_sentences.size())}) {
+      assert(batch.size() == inference_data.size());
+      vector<vector<int>> batch_ids;
+      status = applyer.encode_as_ids(batch, &batch_ids, true, true);
+      assert(status.ok());
+      assert(batch_ids == ids_parallel);
+      vector<int> batch_flat;
+      vector<uint64_t> batch_offsets;
+      status = applyer.encode_as_ids_flat(batch, &batch_flat, &batch_offsets, true, true);
+      assert(status.ok());
+      assert(batch_flat == ids_flat && batch_offsets == offsets);
+    }
+
+    BaseEncoder cached_applyer(learned_model, 20, EncoderConfig(1 << 14));
+    for (int repeat = 0; repeat < 2; repeat++) {
+      vector<vector<string>> result_cached;
+      status = cached_applyer.encode_as_subwords(inference_data, &result_cached);
+      assert(status.ok());
+      assert(result_sentence_by_sentence == result_cached);
+    }
+    assert(cached_applyer.cache_stats().hits > 0);
+
+    // BPE-dropout with a fixed seed doesn't depend on the number of threads.
+    BaseEncoder single_thread_applyer(learned_model, 1);
+    vector<vector<int>> dropout_parallel, dropout_single_thread;
+    status = applyer.encode_as_ids(inference_data, &dropout_parallel, false, false, false, 0.3, i);
+    assert(status.ok());
+    status = single_thread_applyer.encode_as_ids(inference_data, &dropout_single_thread, false, false,
+                                                 false, 0.3, i);
+    assert(status.ok());
+    assert(dropout_parallel == dropout_single_thread);
+    status = applyer.encode_as_ids_flat(inference_data, &ids_flat, &offsets, false, false, false, 0.3, i);
+    assert(status.ok());
+    for (uint64_t j = 0; j < inference_data.size(); j++) {
+      assert(vector<int>(ids_flat.begin() + offsets[j], ids_flat.begin() + offsets[j + 1]) ==
+             dropout_parallel[j]);
+    }
+
+    // Concurrent calls on the same encoder give the same results as calls one at a time.
+    vector<string> decoded_parallel;
+    status = applyer.decode(ids_parallel, &decoded_parallel, nullptr);
+    assert(status.ok());
+    vector<thread> callers;
+    for (int t = 0; t < 4; t++) {
+      callers.emplace_back([&, t]() {
+        const BaseEncoder &encoder = t % 2 == 0 ? applyer : cached_applyer;
+        for (int repeat = 0; repeat < 3; repeat++) {
+          vector<vector<int>> ids;
+          Status call_status = encoder.encode_as_ids(inference_data, &ids, true, true);
+          assert(call_status.ok());
+          assert(ids == ids_parallel);
+          call_status = encoder.encode_as_ids(inference_data, &ids, false, false, false, 0.3, i);
+          assert(call_status.ok());
+          assert(ids == dropout_parallel);
+          vector<string> decoded;
+          call_status = encoder.decode(ids_parallel, &decoded, nullptr);
+          assert(call_status.ok());
+          assert(decoded == decoded_parallel);
+        }
+      });
+    }
+    for (auto &caller : callers) {
+      caller.join();
+    }
+
+    for (int repeat = 0; repeat < 4; repeat++) {
+      fixed_test(applyer, inference_data, rnd);
+      fixed_test(cached_applyer, inference_data, rnd);
+    }
+
+    // The k-th sample of a sentence is the same as the sentence repeated n_samples times.
+    const uint64_t n_samples = 3;
+    vector<string> repeated_data;
+    for (const auto &sentence : inference_data) {
+      repeated_data.insert(repeated_data.end(), n_samples, sentence);
+    }
+    vector<vector<int>> dropout_repeated;
+    status = applyer.encode_as_ids(repeated_data, &dropout_repeated, true, false, true, 0.3, i);
+    assert(status.ok());
+    status = applyer.encode_as_ids_samples(inference_data, n_samples, &ids_flat, &offsets, true, false,
+                                           true, 0.3, i);
+    assert(status.ok());
+    assert(offsets.size() == repeated_data.size() + 1);
+    for (uint64_t j = 0; j < repeated_data.size(); j++) {
+      assert(vector<int>(ids_flat.begin() + offsets[j], ids_flat.begin() + offsets[j + 1]) ==
+             dropout_repeated[j]);
+    }
+  }
+}
+
+vector<uint32_t> decode_utf8_slow(const string &text, uint64_t *n_invalid) {
+  vector<uint32_t> result;
+  uint64_t utf8_len = 0;
+  for (uint64_t i = 0; i < text.size(); i += utf8_len) {
+    uint32_t code_point = chars_to_utf8(text.data() + i, text.size() - i, &utf8_len);
+    if (code_point == INVALID_UNICODE) {
+      (*n_invalid)++;
+    } else {
+      result.push_back(code_point);
+    }
   }
+  return result;
+}
+
+vector<string> split_words_slow(const string &text) {
+  vector<string> words;
+  string word;
+  uint64_t utf8_len = 0;
+  for (uint64_t i = 0; i < text.size(); i += utf8_len) {
+    uint32_t code_point = chars_to_utf8(text.data() + i, text.size() - i, &utf8_len);
+    if (code_point != INVALID_UNICODE && is_space(code_point)) {
+      if (!word.empty()) {
+        words.push_back(word);
+      }
+      word.clear();
+    } else {
+      word.append(text, i, utf8_len);
+    }
+  }
+  if (!word.empty()) {
+    words.push_back(word);
+  }
+  return words;
+}
+
+void utf8_stress(int n_iter) {
+  mt19937 rnd;
+  // ASCII, two-byte, three-byte and four-byte characters, and bytes that make invalid sequences.
+  const vector<string> pieces = {"a", " ", "\n", "\xD0\xB6", "\xC2\xA0", "\xD7\x90", "\xE2\x96\x81",
+                                 "\xE4\xB8\xAD", "\xF0\x9F\x98\x80", "\x80", "\xC1\xBF", "\xE0\x80\x80",
+                                 "\xED\xA0\x80", "\xF4\x90\x80\x80", "\xD0", "\xFF", "\t", "\xE2\x96",
+                                 "\xE2\x80\x83"};
+  for (int it = 0; it != n_iter; it++) {
+    rnd.seed(it);
+    // Some tests have long runs of one kind of characters, as in real text.
+    int n_kinds = uniform_dist_int(rnd, 1, pieces.size() + 1);
+    int len = uniform_dist_int(rnd, 0, 300);
+    string text;
+    for (int i = 0; i < len; i++) {
+      text += pieces[uniform_dist_int(rnd, 0, n_kinds)];
+    }
+
+    uint64_t expected_invalid = 0;
+    auto expected = decode_utf8_slow(text, &expected_invalid);
+    vector<uint32_t> decoded = {42};
+    uint64_t n_invalid = 0;
+    bool valid = decode_utf8(text.data(), text.data() + text.size(), &decoded, &n_invalid);
+    assert(decoded[0] == 42);
+    assert(vector<uint32_t>(decoded.begin() + 1, decoded.end()) == expected);
+    assert(n_invalid == expected_invalid);
+    assert(valid == (expected_invalid == 0));
+
+    const char *begin = text.data();
+    const char *end = text.data() + text.size();
+    uint64_t max_bytes = uniform_dist_int(rnd, 1, 20);
+    decoded.clear();
+    n_invalid = 0;
+    while (begin != end) {
+      const char *split = utf8_split_point(begin, end, max_bytes);
+      assert(begin < split && split <= end && split - begin <= max<long long>(max_bytes, 4));
+      decode_utf8(begin, split, &decoded, &n_invalid);
+      begin = split;
+    }
+    assert(decoded == expected);
+    assert(n_invalid == expected_invalid);
+
+    vector<WordSpan> spans;
+    uint64_t max_words = uniform_dist_int(rnd, 1, 20);
+    begin = text.data();
+    while (begin != end) {
+      uint64_t n_words = spans.size();
+      begin = split_words(begin, end, &spans, max_words);
+      assert(spans.size() - n_words <= max_words);
+    }
+    vector<string> words;
+    for (const auto &span : spans) {
+      words.emplace_back(span.begin, span.end);
+    }
+    assert(words == split_words_slow(text));
+
+    // Integer formatting of the command line tools
+    int64_t value = static_cast<int64_t>(rnd()) >> uniform_dist_int(rnd, 0, 32);
+    if (rnd() % 2) {
+      value = -value;
+    }
+    string formatted = "x";
+    append_int(value, &formatted);
+    assert(formatted == "x" + std::to_string(value));
+
+    // Integer parsing of decode_cli stops where operator>> of a stream stops
+    const vector<string> int_pieces = {"1", "23", "-4", "+5", "0", " ", "\t", "\r", "x",
+                                       "2147483647", "-2147483648", "99999999999", "-", "+"};
+    string ints_text;
+    int n_pieces = uniform_dist_int(rnd, 0, 30);
+    for (int i = 0; i < n_pieces; i++) {
+      ints_text += int_pieces[uniform_dist_int(rnd, 0, int_pieces.size())];
+      if (rnd() % 2) {
+        ints_text += ' ';
+      }
+    }
+    std::stringstream stream(ints_text);
+    vector<int> expected_ints;
+    int parsed;
+    while (stream >> parsed) {
+      expected_ints.push_back(parsed);
+    }
+    vector<int> ints = {42};
+    parse_ints(ints_text.data(), ints_text.data() + ints_text.size(), &ints);
+    assert(ints[0] == 42);
+    assert(vector<int>(ints.begin() + 1, ints.end()) == expected_ints);
+  }
+  for (int64_t value : vector<int64_t>{0, 9, 10, 99, 100, -1, std::numeric_limits<int>::max(),
+                                       std::numeric_limits<int>::min()}) {
+    string formatted;
+    append_int(value, &formatted);
+    assert(formatted == std::to_string(value));
+  }
+}
+
+// Loads a copy of the binary model at path in which the uint32_t at position pos
+// of the section is replaced by value. If section_size is given, the section is
+// also shrunk to section_size bytes.
+Status load_corrupted_model(const string &path, ModelSection section, uint64_t pos,
+                            uint32_t value, uint64_t section_size = 0) {
+  ifstream fin(path, ios::binary);
+  string data((istreambuf_iterator<char>(fin)), istreambuf_iterator<char>());
+  ModelHeader header;
+  memcpy(&header, data.data(), sizeof(header));
+  assert((pos + 1) * sizeof(uint32_t) <= header.section_size[section]);
+  memcpy(&data[header.section_offset[section] + pos * sizeof(uint32_t)], &value, sizeof(value));
+  if (section_size != 0) {
+    assert(section_size <= header.section_size[section]);
+    header.section_size[section] = section_size;
+    memcpy(&data[0], &header, sizeof(header));
+  }
+  ofstream("remove_it_corrupted.bin", ios::binary) << data;
+  Status status;
+  BaseEncoder encoder("remove_it_corrupted.bin", 1, &status);
+  remove("remove_it_corrupted.bin");
+  return status;
 }
 
 void base_stress(int n_iter) {
@@ -468,6 +797,71 @@ void base_stress(int n_iter) {
     assert(fast_ids == slow_results.ids);
     assert(fast_pieces == slow_pieces);
 
+    EncoderConfig backtracking_config;
+    backtracking_config.engine = BACKTRACKING;
+    BaseEncoder backtracking_applyer(fast_solution_model, 1, backtracking_config);
+    assert(backtracking_applyer.encoding_engine() == BACKTRACKING);
+    vector<vector<int>> backtracking_ids;
+    status = backtracking_applyer.encode_as_ids({inference_data}, &backtracking_ids);
+    assert(status.ok());
+    if (backtracking_ids[0] != fast_ids) {
+      cerr << "ids backtracking: ";
+      for (auto x: backtracking_ids[0]) cerr << x << " ";
+      cerr << endl;
+    }
+    assert(backtracking_ids[0] == fast_ids);
+
+    EncoderConfig sparse_config;
+    sparse_config.dense_char_limit = uniform_dist_int(rnd, 0, 300);
+    BaseEncoder sparse_applyer(fast_solution_model, 1, sparse_config);
+    status = sparse_applyer.dump_binary("remove_it.bin");
+    assert(status.ok());
+    BaseEncoder binary_applyer("remove_it.bin", 1, &status);
+    assert(status.ok());
+    vector<vector<int>> binary_ids;
+    status = binary_applyer.encode_as_ids({inference_data}, &binary_ids);
+    assert(status.ok());
+    assert(binary_ids[0] == fast_ids);
+    assert(binary_applyer.vocabulary() == applyer.vocabulary());
+    uint32_t n_tokens = applyer.vocab_size();
+    uint64_t code_point = uniform_dist_int(rnd, 0, 128);
+    assert(load_corrupted_model("remove_it.bin", MODEL_CHAR_DENSE, code_point, CharTable::NOT_FOUND).ok());
+    assert(!load_corrupted_model("remove_it.bin", MODEL_CHAR_DENSE, code_point, n_tokens).ok());
+    // A table of one empty 16-byte slot would make the hash shift by 64 bits.
+    assert(!load_corrupted_model("remove_it.bin", MODEL_RULE_SLOTS, 2, static_cast<uint32_t>(-1), 16).ok());
+    for (const auto &x : fast_solution_model.char2id) {
+      uint64_t pos = binary_applyer.token_chars(x.second).data - binary_applyer.token_chars(0).data;
+      assert(!load_corrupted_model("remove_it.bin", MODEL_TOKEN_CHAR_POOL, pos, x.first + 1).ok());
+      break;
+    }
+    if (!fast_solution_model.rules.empty()) {
+      uint32_t z = fast_solution_model.rules.back().z;
+      assert(!load_corrupted_model("remove_it.bin", MODEL_MERGE_TREE, 2 * z, n_tokens).ok());
+      assert(!load_corrupted_model("remove_it.bin", MODEL_MERGE_TREE, 2 * z + 1, NO_TOKEN).ok());
+    }
+
+    map<uint32_t, vector<uint32_t>> recipe;
+    for (auto x: fast_solution_model.char2id) {
+      recipe[x.second] = {x.first};
+      assert(applyer.merge_node(x.second).x == NO_TOKEN);
+    }
+    for (auto rule: fast_solution_model.rules) {
+      recipe[rule.z] = recipe[rule.x];
+      recipe[rule.z].insert(recipe[rule.z].end(), recipe[rule.y].begin(), recipe[rule.y].end());
+      assert(applyer.merge_node(rule.z).x == rule.x && applyer.merge_node(rule.z).y == rule.y);
+      assert(binary_applyer.merge_node(rule.z).x == rule.x);
+    }
+    for (int id = 0; id < applyer.vocab_size(); id++) {
+      for (const BaseEncoder *encoder: {&applyer, &binary_applyer}) {
+        CodePointsView chars = encoder->token_chars(id);
+        assert(vector<uint32_t>(chars.begin(), chars.end()) == recipe[id]);
+      }
+    }
+    for (int id = 0; id < applyer.vocab_size(); id++) {
+      string subword = applyer.piece(id).str();
+      assert(binary_applyer.subword_to_id(subword) == applyer.subword_to_id(subword));
+    }
+
     string fast_result_one_line;
     for (const auto &x: fast_pieces) fast_result_one_line += x;
     string slow_result_one_line = "";
@@ -507,6 +901,11 @@ int main(int argc, char **argv) {
       vkcom::parallel_test(n_iter, 8);
       return 0;
     }
+    if (std::string(argv[1]) == "utf8") {
+      sscanf(argv[2], "%d", &n_iter);
+      vkcom::utf8_stress(n_iter);
+      return 0;
+    }
     if (std::string(argv[1]) == "base") {
       sscanf(argv[2], "%d", &n_iter);
       vkcom::base_stress(n_iter);
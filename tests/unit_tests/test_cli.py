@@ -1,6 +1,9 @@
 import os
 import random
-from subprocess import run
+import shutil
+from subprocess import PIPE, Popen, run
+
+import youtokentome as yttm
 
 from utils_for_testing import (
     BASE_MODEL_FILE,
@@ -194,6 +197,7 @@ def test_decode():
         "decode",
         f"--model={BASE_MODEL_FILE}",
         f"--ignore_ids={BOS_ID},{EOS_ID}",
+        "--n_threads=2",
     ]
     run(
         cmd_args,
@@ -207,6 +211,250 @@ def test_decode():
 
     assert text_in == text_out[:-1]
 
+    cmd_args = ["yttm", "decode", f"--model={BASE_MODEL_FILE}", "--n_threads=0"]
+    assert run(cmd_args, stdin=open("decode_id.txt", "r")).returncode != 0
+
     os.remove("decode_text_in.txt")
     os.remove("decode_text_out.txt")
     os.remove("decode_id.txt")
+
+
+def test_binary_output():
+    generate_artifacts()
+    cmd_args = [
+        "yttm",
+        "encode",
+        f"--model={BASE_MODEL_FILE}",
+        "--output_type=id",
+        "--bos",
+    ]
+    run(cmd_args, stdin=open(TEST_FILE, "r"), stdout=open("log.txt", "w"), check=True)
+    with open("log.txt") as fin:
+        expected = [list(map(int, line.split())) for line in fin]
+
+    cmd_args = [
+        "yttm",
+        "encode",
+        f"--model={BASE_MODEL_FILE}",
+        "--output_type=binary",
+        "--output=dataset.bin",
+        "--bos",
+    ]
+    run(cmd_args, stdin=open(TEST_FILE, "r"), check=True)
+
+    with yttm.Dataset("dataset.bin") as dataset:
+        assert dataset.id_size == 2
+        assert dataset.model_hash == yttm.BPE(BASE_MODEL_FILE).model_hash()
+        assert dataset.bos_id == BOS_ID and dataset.eos_id == EOS_ID
+        assert len(dataset) == len(expected)
+        assert [dataset[i].tolist() for i in range(len(dataset))] == expected
+        assert dataset[-1].tolist() == expected[-1]
+        assert len(dataset.ids) == sum(map(len, expected))
+
+    cmd_args = ["yttm", "encode", f"--model={BASE_MODEL_FILE}", "--output_type=binary"]
+    assert run(cmd_args, stdin=open(TEST_FILE, "r")).returncode != 0
+
+    os.remove("log.txt")
+    os.remove("dataset.bin")
+    os.remove("dataset.bin.idx")
+
+
+def test_file_mode():
+    generate_artifacts()
+    for output_type in ["id", "subword"]:
+        cmd_args = [
+            "yttm",
+            "encode",
+            f"--model={BASE_MODEL_FILE}",
+            f"--output_type={output_type}",
+            "--eos",
+        ]
+        run(
+            cmd_args,
+            stdin=open(TEST_FILE, "r"),
+            stdout=open("log.txt", "w"),
+            check=True,
+        )
+        with open("log.txt") as fin:
+            expected = fin.read()
+
+        for n_threads in [1, 4]:
+            run(
+                cmd_args + [f"--input={TEST_FILE}", f"--n_threads={n_threads}"],
+                stdout=open("log.txt", "w"),
+                check=True,
+            )
+            with open("log.txt") as fin:
+                assert fin.read() == expected
+
+            run(
+                cmd_args
+                + [
+                    f"--input={TEST_FILE}",
+                    "--output=encoded.txt",
+                    f"--n_threads={n_threads}",
+                ],
+                check=True,
+            )
+            with open("encoded.txt") as fin:
+                assert fin.read() == expected
+
+    cmd_args = [
+        "yttm",
+        "encode",
+        f"--model={BASE_MODEL_FILE}",
+        "--output_type=id",
+        "--stream",
+        f"--input={TEST_FILE}",
+    ]
+    assert run(cmd_args).returncode != 0
+
+    # The output can't be the mapped input itself, it would be truncated.
+    shutil.copyfile(TEST_FILE, "same_file.txt")
+    with open(TEST_FILE) as fin:
+        text = fin.read()
+    for output_type, output in [
+        ("id", "same_file.txt"),
+        ("subword", "./same_file.txt"),
+        ("binary", "same_file.txt"),
+    ]:
+        cmd_args = [
+            "yttm",
+            "encode",
+            f"--model={BASE_MODEL_FILE}",
+            f"--output_type={output_type}",
+            "--input=same_file.txt",
+            f"--output={output}",
+        ]
+        assert run(cmd_args).returncode != 0
+        with open("same_file.txt") as fin:
+            assert fin.read() == text
+    shutil.copyfile(TEST_FILE, "same_file.txt.idx")
+    cmd_args = [
+        "yttm",
+        "encode",
+        f"--model={BASE_MODEL_FILE}",
+        "--output_type=binary",
+        "--input=same_file.txt.idx",
+        "--output=same_file.txt",
+    ]
+    assert run(cmd_args).returncode != 0
+    assert os.path.getsize("same_file.txt.idx") == os.path.getsize(TEST_FILE)
+
+    # Write errors are reported whether the text is read from stdin or mapped.
+    if os.path.exists("/dev/full"):
+        for output_type in ["id", "subword"]:
+            cmd_args = [
+                "yttm",
+                "encode",
+                f"--model={BASE_MODEL_FILE}",
+                f"--output_type={output_type}",
+            ]
+            for extra_args in [[], [f"--input={TEST_FILE}"]]:
+                with open(TEST_FILE) as fin:
+                    result = run(
+                        cmd_args + extra_args + ["--output=/dev/full"], stdin=fin
+                    )
+                assert result.returncode != 0
+                with open(TEST_FILE) as fin, open("/dev/full", "w") as fout:
+                    result = run(cmd_args + extra_args, stdin=fin, stdout=fout)
+                assert result.returncode != 0
+        # The first failed write stops the encoding of an endless stdin.
+        with Popen(["yes", "endless text"], stdout=PIPE) as endless:
+            result = run(
+                cmd_args + ["--output=/dev/full"], stdin=endless.stdout, timeout=60
+            )
+            endless.kill()
+        assert result.returncode != 0
+
+    os.remove("log.txt")
+    os.remove("encoded.txt")
+    os.remove("same_file.txt")
+    os.remove("same_file.txt.idx")
+
+
+def test_file_mode_blocks():
+    # About 10 MB: several blocks of the file mode, in more than one round.
+    generate_artifacts()
+    with open(TEST_FILE) as fin:
+        text = fin.read()
+    with open("big_input.txt", "w") as fout:
+        fout.write((text * 10).rstrip("\n"))
+
+    for output_type in ["id", "subword"]:
+        cmd_args = [
+            "yttm",
+            "encode",
+            f"--model={BASE_MODEL_FILE}",
+            f"--output_type={output_type}",
+            "--bos",
+        ]
+        run(
+            cmd_args + ["--n_threads=1"],
+            stdin=open("big_input.txt", "r"),
+            stdout=open("expected.txt", "w"),
+            check=True,
+        )
+        with open("expected.txt") as fin:
+            expected = fin.read()
+        for n_threads in [1, 2]:
+            args = ["--input=big_input.txt", f"--n_threads={n_threads}"]
+            run(cmd_args + args, stdout=open("encoded.txt", "w"), check=True)
+            with open("encoded.txt") as fin:
+                assert fin.read() == expected
+            run(cmd_args + args + ["--output=encoded.txt"], check=True)
+            with open("encoded.txt") as fin:
+                assert fin.read() == expected
+
+    outputs = []
+    for n_threads in [1, 2]:
+        for output_type in ["id", "binary"]:
+            output = f"dropout_{output_type}_{n_threads}"
+            cmd_args = [
+                "yttm",
+                "encode",
+                f"--model={BASE_MODEL_FILE}",
+                f"--output_type={output_type}",
+                "--dropout_prob=0.3",
+                "--dropout_seed=7",
+                "--input=big_input.txt",
+                f"--output={output}",
+                f"--n_threads={n_threads}",
+            ]
+            run(cmd_args, check=True)
+        with open(f"dropout_id_{n_threads}") as fin:
+            ids = fin.read()
+        with open(f"dropout_binary_{n_threads}", "rb") as fin:
+            dataset = fin.read()
+        with open(f"dropout_binary_{n_threads}.idx", "rb") as fin:
+            dataset_index = fin.read()
+        outputs.append((ids, dataset, dataset_index))
+        os.remove(f"dropout_id_{n_threads}")
+        os.remove(f"dropout_binary_{n_threads}")
+        os.remove(f"dropout_binary_{n_threads}.idx")
+    assert outputs[0] == outputs[1]
+
+    os.remove("big_input.txt")
+    os.remove("expected.txt")
+    os.remove("encoded.txt")
+
+
+def test_convert():
+    generate_artifacts()
+    run(
+        ["yttm", "convert", f"--model={BASE_MODEL_FILE}", "--output=model.bin"],
+        check=True,
+    )
+    for model in [BASE_MODEL_FILE, "model.bin"]:
+        run(
+            ["yttm", "encode", f"--model={model}", "--output_type=subword"],
+            stdin=open(TEST_FILE, "r"),
+            stdout=open(model + ".txt", "w"),
+            check=True,
+        )
+    with open(BASE_MODEL_FILE + ".txt") as expected, open("model.bin.txt") as fin:
+        assert fin.read() == expected.read()
+
+    os.remove("model.bin")
+    os.remove("model.bin.txt")
+    os.remove(BASE_MODEL_FILE + ".txt")
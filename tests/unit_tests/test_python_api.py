@@ -1,5 +1,9 @@
+import array
 import os
 import random
+from concurrent.futures import ThreadPoolExecutor
+
+import pytest
 
 import youtokentome as yttm
 from utils_for_testing import (
@@ -49,3 +53,232 @@ def test_vocabulary_consistency():
     for i, subword in enumerate(vc):
         assert i == bpe.subword_to_id(subword)
         assert subword == bpe.id_to_subword(i)
+
+
+def test_word_cache():
+    generate_artifacts()
+    bpe = yttm.BPE(BASE_MODEL_FILE)
+    bpe_cached = yttm.BPE(BASE_MODEL_FILE, cache_size=1 << 20)
+    with open(TEST_FILE) as fin:
+        text = fin.read().splitlines()
+
+    for output_type in [yttm.OutputType.ID, yttm.OutputType.SUBWORD]:
+        expected = bpe.encode(text, output_type)
+        assert bpe_cached.encode(text, output_type) == expected
+        assert bpe_cached.encode(text, output_type) == expected
+
+    stats = bpe_cached.cache_stats()
+    assert stats["hits"] > 0
+    assert stats["entries"] > 0
+    assert stats["memory"] <= 1 << 20
+    assert bpe.cache_stats()["hits"] == 0
+
+    tiny_cache = yttm.BPE(BASE_MODEL_FILE, cache_size=16384)
+    assert tiny_cache.encode(text) == bpe.encode(text)
+    assert tiny_cache.cache_stats()["memory"] <= 16384
+
+
+def test_encode_flat():
+    generate_artifacts()
+    bpe = yttm.BPE(BASE_MODEL_FILE)
+    with open(TEST_FILE) as fin:
+        text = fin.read().splitlines()
+
+    expected = bpe.encode(text, bos=True, eos=True, reverse=True)
+    ids, offsets = bpe.encode_flat(text, bos=True, eos=True, reverse=True)
+    assert len(offsets) == len(text) + 1
+    assert offsets[0] == 0 and offsets[-1] == len(ids)
+    for i, sentence in enumerate(expected):
+        assert ids[offsets[i] : offsets[i + 1]].tolist() == sentence
+
+    ids, offsets = bpe.encode_flat([])
+    assert len(ids) == 0 and offsets.tolist() == [0]
+
+
+def test_encode_numpy():
+    np = pytest.importorskip("numpy")
+    generate_artifacts()
+    bpe = yttm.BPE(BASE_MODEL_FILE)
+    with open(TEST_FILE) as fin:
+        text = fin.read().splitlines()
+
+    expected = bpe.encode(text, bos=True, eos=True)
+    for dtype in ["int32", "uint16"]:
+        ids, offsets = bpe.encode_numpy(text, dtype=dtype, bos=True, eos=True)
+        assert ids.dtype == np.dtype(dtype) and offsets.dtype == np.uint64
+        for i, sentence in enumerate(expected):
+            assert ids[offsets[i] : offsets[i + 1]].tolist() == sentence
+
+        matrix, lengths = bpe.encode_numpy(text, padded=True, dtype=dtype, bos=True, eos=True)
+        assert matrix.dtype == np.dtype(dtype)
+        assert matrix.shape == (len(text), max(map(len, expected)))
+        for i, sentence in enumerate(expected):
+            assert lengths[i] == len(sentence)
+            assert matrix[i, : lengths[i]].tolist() == sentence
+            assert (matrix[i, lengths[i] :] == 0).all()
+
+    matrix, lengths = bpe.encode_numpy([], padded=True)
+    assert matrix.shape == (0, 0) and lengths.shape == (0,)
+
+
+def test_dropout_seed():
+    generate_artifacts()
+    with open(TEST_FILE) as fin:
+        text = fin.read().splitlines()
+
+    expected = yttm.BPE(BASE_MODEL_FILE, n_threads=1).encode(
+        text, dropout_prob=0.3, dropout_seed=17
+    )
+    bpe = yttm.BPE(BASE_MODEL_FILE, n_threads=4)
+    assert bpe.encode(text, dropout_prob=0.3, dropout_seed=17) == expected
+    assert bpe.encode(text, dropout_prob=0.3, dropout_seed=18) != expected
+    ids, offsets = bpe.encode_flat(text, dropout_prob=0.3, dropout_seed=17)
+    for i, sentence in enumerate(expected):
+        assert ids[offsets[i] : offsets[i + 1]].tolist() == sentence
+    with pytest.raises(ValueError):
+        bpe.encode(text, dropout_prob=0.3, dropout_seed=-1)
+
+
+def test_sentences_in_place():
+    generate_artifacts()
+    bpe = yttm.BPE(BASE_MODEL_FILE)
+    with open(TEST_FILE) as fin:
+        text = fin.read().splitlines()[:1000]
+    text[1] = "ab " + "\u0444\u044b\u0432" + " cd"
+    text[2] = ""
+
+    expected = bpe.encode(text, bos=True)
+    encoded = [sentence.encode() for sentence in text]
+    assert bpe.encode(encoded, bos=True) == expected
+    assert bpe.encode([bytearray(x) for x in encoded], bos=True) == expected
+    assert bpe.encode([memoryview(x) for x in encoded], bos=True) == expected
+    assert bpe.encode(encoded[0], bos=True) == expected[0]
+
+    data = b"prefix" + b"".join(encoded)
+    offsets = [len(b"prefix")]
+    for sentence in encoded:
+        offsets.append(offsets[-1] + len(sentence))
+    for typecode in ["i", "q", "Q"]:
+        packed = yttm.PackedSentences(data, array.array(typecode, offsets))
+        assert len(packed) == len(text)
+        assert bpe.encode(packed, bos=True) == expected
+        assert bpe.encode(packed, yttm.OutputType.SUBWORD) == bpe.encode(
+            text, yttm.OutputType.SUBWORD
+        )
+        ids, ids_offsets = bpe.encode_flat(packed, bos=True)
+        for i, sentence in enumerate(expected):
+            assert ids[ids_offsets[i] : ids_offsets[i + 1]].tolist() == sentence
+
+    assert bpe.encode(yttm.PackedSentences(b"", array.array("q", [0]))) == []
+    with pytest.raises(ValueError):
+        yttm.PackedSentences(data, array.array("q", [0, 5, 3]))
+    with pytest.raises(ValueError):
+        yttm.PackedSentences(data, array.array("q", [0, len(data) + 1]))
+    with pytest.raises(ValueError):
+        yttm.PackedSentences(data, array.array("i", [-1, 0]))
+    with pytest.raises(TypeError):
+        yttm.PackedSentences(data, array.array("d", [0, 1]))
+
+
+def test_concurrent_calls():
+    generate_artifacts()
+    with open(TEST_FILE) as fin:
+        text = fin.read().splitlines()[:2000]
+
+    bpe = yttm.BPE(BASE_MODEL_FILE, n_threads=4, cache_size=1 << 20)
+    expected_ids = bpe.encode(text, bos=True)
+    expected_subwords = bpe.encode(text, yttm.OutputType.SUBWORD)
+    expected_dropout = bpe.encode(text, dropout_prob=0.3, dropout_seed=5)
+    expected_decoded = bpe.decode(expected_ids, ignore_ids=[BOS_ID])
+
+    def worker(k):
+        for _ in range(3):
+            assert bpe.encode(text, bos=True) == expected_ids
+            assert bpe.encode(text, yttm.OutputType.SUBWORD) == expected_subwords
+            assert bpe.encode(text, dropout_prob=0.3, dropout_seed=5) == expected_dropout
+            assert bpe.decode(expected_ids, ignore_ids=[BOS_ID]) == expected_decoded
+            ids, offsets = bpe.encode_flat(text, bos=True)
+            assert ids[offsets[k] : offsets[k + 1]].tolist() == expected_ids[k]
+
+    with ThreadPoolExecutor(max_workers=8) as executor:
+        list(executor.map(worker, range(8)))
+
+
+def test_encode_samples():
+    generate_artifacts()
+    bpe = yttm.BPE(BASE_MODEL_FILE)
+    with open(TEST_FILE) as fin:
+        text = fin.read().splitlines()
+
+    n_samples = 4
+    repeated = [sentence for sentence in text for _ in range(n_samples)]
+    expected = bpe.encode(repeated, bos=True, dropout_prob=0.2, dropout_seed=3)
+    ids, offsets = bpe.encode_samples(
+        text, n_samples, dropout_prob=0.2, bos=True, dropout_seed=3
+    )
+    assert len(offsets) == len(text) * n_samples + 1
+    for i, sample in enumerate(expected):
+        assert ids[offsets[i] : offsets[i + 1]].tolist() == sample
+    with pytest.raises(ValueError):
+        bpe.encode_samples(text, 0, dropout_prob=0.2)
+
+
+def test_encode_fixed():
+    np = pytest.importorskip("numpy")
+    generate_artifacts()
+    bpe = yttm.BPE(BASE_MODEL_FILE)
+    with open(TEST_FILE) as fin:
+        text = fin.read().splitlines()
+
+    max_len = 12
+    expected = bpe.encode(text, bos=True, eos=True)
+    matrix, lengths = bpe.encode_fixed(text, max_len, bos=True, eos=True)
+    matrix = np.asarray(matrix)
+    assert matrix.shape == (len(text), max_len) and matrix.dtype == np.int32
+    for i, sentence in enumerate(expected):
+        row = sentence[: max_len - 1] + [EOS_ID] if len(sentence) > max_len else sentence
+        assert lengths[i] == len(row)
+        assert matrix[i].tolist() == row + [0] * (max_len - len(row))
+
+    out = np.full((len(text), max_len), 7, dtype=np.uint16)
+    result, lengths = bpe.encode_fixed(
+        text, max_len, truncate="left", out=out, dtype="uint16", bos=True, eos=True
+    )
+    assert result is out
+    for i, sentence in enumerate(expected):
+        row = [BOS_ID] + sentence[-(max_len - 1) :] if len(sentence) > max_len else sentence
+        assert out[i].tolist() == row + [0] * (max_len - len(row))
+
+    with pytest.raises(ValueError):
+        bpe.encode_fixed(text, max_len, out=np.zeros((1, max_len), dtype=np.int32))
+
+
+def test_binary_model():
+    generate_artifacts()
+    bpe = yttm.BPE(BASE_MODEL_FILE)
+    bpe.save_binary("model.bin")
+    bpe_binary = yttm.BPE("model.bin")
+
+    with open(TEST_FILE) as fin:
+        text = fin.read().splitlines()
+    assert bpe_binary.model_hash() == bpe.model_hash()
+    assert bpe_binary.vocab() == bpe.vocab()
+    for output_type in [yttm.OutputType.ID, yttm.OutputType.SUBWORD]:
+        assert bpe_binary.encode(text, output_type) == bpe.encode(text, output_type)
+    ids = bpe.encode(text, yttm.OutputType.ID)
+    assert bpe_binary.decode(ids) == bpe.decode(ids)
+    for i, subword in enumerate(bpe.vocab()):
+        assert bpe_binary.subword_to_id(subword) == i
+    assert bpe_binary.subword_to_id("not a subword") == bpe.subword_to_id("not a subword")
+
+    # The model is mapped, replacing the file must not affect loaded models.
+    yttm.BPE(RENAME_ID_MODEL_FILE).save_binary("model.bin")
+    assert bpe_binary.encode(text) == bpe.encode(text)
+
+    with open("model.bin", "rb") as fin:
+        data = fin.read()
+    with open("model.bin", "wb") as fout:
+        fout.write(data[: len(data) // 2])
+    with pytest.raises(ValueError):
+        yttm.BPE("model.bin")
+    os.remove("model.bin")
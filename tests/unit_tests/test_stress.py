@@ -48,3 +48,8 @@ def test_parallel():
     compile_test()
     run(["./stress", "parallel", "50"], check=True)
     os.remove("remove_it.txt")
+
+
+def test_utf8():
+    compile_test()
+    run(["./stress", "utf8", "10000"], check=True)
@@ -1,2 +1,4 @@
 from .youtokentome import BPE
+from .youtokentome import Dataset
 from .youtokentome import OutputType
+from .youtokentome import PackedSentences
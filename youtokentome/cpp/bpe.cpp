@@ -9,10 +9,10 @@
 #include <cstring>
 #include <functional>
 #include <iostream>
+#include <limits>
 #include <mutex>
 #include <queue>
 #include <random>
-#include <sstream>
 #include <string>
 #include <thread>
 #include <unordered_set>
@@ -83,15 +83,6 @@ Status fast_read_file_utf8(const std::string &file_name, std::string *file_conte
   }
 }
 
-std::string token2word(const std::vector<uint32_t> &source,
-                       const flat_hash_map<uint32_t, uint32_t> &id2char) {
-  std::vector<uint32_t> res;
-  for (int i : source) {
-    assert(id2char.count(i) == 1);
-    res.push_back(id2char.at(i));
-  }
-  return encode_utf8(res);
-}
 
 uint64_t int2comb(uint32_t a, uint32_t b) {
   return (static_cast<uint64_t >(a) << 32u) + b;
@@ -354,24 +345,33 @@ flat_hash_map<uint32_t, uint32_t> compute_alphabet_helper(
   return char2id;
 }
 
+// Training text is decoded by chunks of this size.
+const uint64_t DECODE_CHUNK_SIZE = 1 << 16;
+// Maximum number of words found by one call of split_words.
+const uint64_t WORD_BATCH_SIZE = 1 << 12;
+
 char* remove_rare_chars(char* begin, char* end, const flat_hash_set<uint32_t> &removed_chars) {
   if (removed_chars.empty()) {
     return end;
   }
   char* end_candidate = begin;
   bool invalid_input = false;
-  UTF8Iterator utf8_iter(begin, end);
-  for (; !utf8_iter.empty(); ++utf8_iter) {
-    if (*utf8_iter != INVALID_UNICODE) {
-      if (removed_chars.count(*utf8_iter) == 0) {
-        char* token_begin = utf8_iter.get_ptr();
-        uint64_t token_len = utf8_iter.get_utf8_len();
-		memcpy(end_candidate, token_begin, token_len);
-		end_candidate += token_len;
+  std::vector<uint32_t> chunk;
+  std::string utf8_char;
+  while (begin != end) {
+    char* chunk_end = const_cast<char*>(utf8_split_point(begin, end, DECODE_CHUNK_SIZE));
+    chunk.clear();
+    invalid_input |= !decode_utf8(begin, chunk_end, &chunk);
+    // Kept characters are encoded back, the result is never longer than the decoded part.
+    for (uint32_t ch : chunk) {
+      if (removed_chars.count(ch) == 0) {
+        utf8_char.clear();
+        utf8_to_chars(ch, std::back_inserter(utf8_char));
+        memcpy(end_candidate, utf8_char.data(), utf8_char.size());
+        end_candidate += utf8_char.size();
       }
-    } else {
-      invalid_input = true;
     }
+    begin = chunk_end;
   }
   if (invalid_input) {
     std::cerr << "WARNING Input contains invalid unicode characters." << std::endl;
@@ -390,28 +390,26 @@ flat_hash_map<VectorSegment, WordCount> compute_word_count(
   const flat_hash_map<uint32_t, uint32_t> &char2id) {
   flat_hash_map<VectorSegment, WordCount> hash2wordcnt;
   std::vector<uint32_t> word;
-  UTF8Iterator utf8_iter(sbegin, send);
-
-  for (;!utf8_iter.empty();) {
-    for (; !utf8_iter.empty() && is_space(*utf8_iter); ++utf8_iter);
-    if (utf8_iter.empty()) {
-      break;
-    }
-    char* begin_of_word = utf8_iter.get_ptr();
-    for (; !utf8_iter.empty() && !is_space(*utf8_iter); ++utf8_iter);
-    char* end_of_word = utf8_iter.get_ptr();
-    VectorSegment word_hash(begin_of_word, end_of_word);
-    auto it = hash2wordcnt.find(word_hash);
-    if (it == hash2wordcnt.end()) {
-      word.clear();
-      word.push_back(char2id.at(SPACE_TOKEN));
-      UTF8Iterator word_iter(begin_of_word, end_of_word);
-      for (; !word_iter.empty(); ++word_iter) {
-        word.push_back(char2id.at(*word_iter));
-      }
-      hash2wordcnt[word_hash] = {word, 1};
-    } else {
-      it->second.cnt++;
+  std::vector<WordSpan> spans;
+
+  const char* it_text = sbegin;
+  while (it_text != send) {
+    spans.clear();
+    it_text = split_words(it_text, send, &spans, WORD_BATCH_SIZE);
+    for (const auto &span : spans) {
+      VectorSegment word_hash(span.begin, span.end);
+      auto it = hash2wordcnt.find(word_hash);
+      if (it == hash2wordcnt.end()) {
+        word.clear();
+        word.push_back(SPACE_TOKEN);
+        decode_utf8(span.begin, span.end, &word);
+        for (auto &ch : word) {
+          ch = char2id.at(ch);
+        }
+        hash2wordcnt[word_hash] = {word, 1};
+      } else {
+        it->second.cnt++;
+      }
     }
   }
   return hash2wordcnt;
@@ -837,23 +835,26 @@ void rename_tokens(flat_hash_map<uint32_t, uint32_t> &char2id,
 }
 
 uint64_t compute_char_count(flat_hash_map<uint32_t, uint64_t>& char_cnt, char* begin, char* end) {
-  bool invalid_input = false;
-  UTF8Iterator utf8_iter(begin, end);
+  uint64_t n_invalid = 0;
   uint64_t char_count = 0;
-  for (; !utf8_iter.empty(); char_count++, ++utf8_iter) {
-    if (*utf8_iter != INVALID_UNICODE) {
-      if (!is_space(*utf8_iter)) {
-        char_cnt[*utf8_iter]++;
+  std::vector<uint32_t> chunk;
+  while (begin != end) {
+    const char* chunk_end = utf8_split_point(begin, end, DECODE_CHUNK_SIZE);
+    chunk.clear();
+    decode_utf8(begin, chunk_end, &chunk, &n_invalid);
+    for (uint32_t ch : chunk) {
+      if (!is_space(ch)) {
+        char_cnt[ch]++;
       }
-    } else {
-      invalid_input = true;
     }
+    char_count += chunk.size();
+    begin = const_cast<char*>(chunk_end);
   }
-  if (invalid_input) {
+  if (n_invalid != 0) {
     std::cerr << "WARNING Input contains invalid unicode characters."
               << std::endl;
   }
-  return char_count;
+  return char_count + n_invalid;
 }
 
 Status learn_bpe_from_string(std::string &text_utf8, int n_tokens,
@@ -1388,421 +1389,1748 @@ Status train_bpe(const std::string &input_path, const std::string &model_path,
 }
 
 
+// Max-heap over an external buffer, so the memory is reused between words.
 template<typename T>
-class BasePriorityQueue {
+class STLQueue {
  public:
-  virtual void push(T x) = 0;
-  virtual bool pop(T& x) = 0;
-  virtual ~BasePriorityQueue() {}
-};
+  explicit STLQueue(std::vector<T> *heap) : q(heap) {
+    q->clear();
+  }
 
-template<typename T>
-class STLQueue : public BasePriorityQueue<T> {
-  std::priority_queue<T> q;
-  void push(T x) override {
-    q.push(x);
+  void push(T x) {
+    q->push_back(x);
+    std::push_heap(q->begin(), q->end());
+  }
+
+  bool empty() const {
+    return q->empty();
+  }
+
+  const T &top() const {
+    return q->front();
   }
-  bool pop(T& x) override {
-    if (q.empty()) {
+
+  bool pop(T &x) {
+    if (q->empty()) {
       return false;
     }
-    x = q.top();
-    q.pop();
+    std::pop_heap(q->begin(), q->end());
+    x = q->back();
+    q->pop_back();
     return true;
   }
+
+ private:
+  std::vector<T> *q;
+};
+
+uint64_t mix_seed(uint64_t x) {
+  x = (x ^ (x >> 30u)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27u)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31u);
+}
+
+// SplitMix64 generator. It's seeded for every sentence, so the result of
+// BPE-dropout doesn't depend on which thread encodes the sentence.
+class DropoutRandom {
+ public:
+  void seed(uint64_t dropout_seed, uint64_t sentence_id) {
+    state = mix_seed(dropout_seed + mix_seed(sentence_id));
+  }
+
+  uint64_t next() {
+    state += 0x9e3779b97f4a7c15ull;
+    return mix_seed(state);
+  }
+
+ private:
+  uint64_t state = 0;
 };
 
-std::mt19937 rnd;
+// Seed of BPE-dropout for calls without an explicit seed.
+uint64_t random_dropout_seed() {
+  static const uint64_t process_seed =
+      (static_cast<uint64_t>(std::random_device()()) << 32u) ^ std::random_device()();
+  static std::atomic<uint64_t> n_calls(0);
+  return mix_seed(process_seed + n_calls++);
+}
+
+EncodingConfig make_encoding_config(bool bos, bool eos, bool reverse, double dropout_prob,
+                                    int64_t dropout_seed) {
+  uint64_t seed = dropout_seed < 0 ? random_dropout_seed() : static_cast<uint64_t>(dropout_seed);
+  return {bos, eos, reverse, dropout_prob, seed};
+}
 
+// Every popped element is skipped with probability skip_prob and stays in the
+// queue for the next pop. Skipped elements are kept in a separate buffer sorted
+// by priority, with the first one to pop at the back, instead of being pushed
+// back into the heap: elements examined by one pop come out in priority order,
+// so the buffer stays sorted.
 template<typename T>
-class DropoutQueue : public BasePriorityQueue<T> {
-  double skip_prob;
-  std::uniform_real_distribution<> dist;
-  std::priority_queue<T> q;
-  std::vector<T> skipped_elements;
+class DropoutQueue {
+  uint64_t skip_threshold;
+  DropoutRandom *random;
+  STLQueue<T> q;
+  std::vector<T> *skipped_elements;
+  std::vector<T> *dropped_elements;
  public:
-  explicit DropoutQueue(double _skip_prob):skip_prob(_skip_prob), dist(std::uniform_real_distribution<>(0, 1))  {}
-  void push(T x) override {
+  DropoutQueue(double skip_prob, DropoutRandom *random, std::vector<T> *heap,
+               std::vector<T> *skipped, std::vector<T> *dropped)
+      : skip_threshold(static_cast<uint64_t>(skip_prob * (1ull << 53u))), random(random),
+        q(heap), skipped_elements(skipped), dropped_elements(dropped) {
+    skipped_elements->clear();
+  }
+
+  void push(T x) {
     q.push(x);
   }
-  bool pop(T& x) override {
-    assert(skipped_elements.empty());
-    while (true) {
-      if (q.empty()) {
-        for (auto y: skipped_elements)  {
-          q.push(y);
-        }
-        skipped_elements.clear();
-        return false;
-      }
-      T temp = q.top();
-      q.pop();
-      if (dist(rnd) < skip_prob) {
-        skipped_elements.push_back(temp);
+
+  bool pop(T &x) {
+    dropped_elements->clear();
+    bool found = false;
+    while (!found) {
+      bool from_skipped = !skipped_elements->empty() &&
+          (q.empty() || !(skipped_elements->back() < q.top()));
+      if (from_skipped) {
+        x = skipped_elements->back();
+        skipped_elements->pop_back();
+      } else if (!q.pop(x)) {
+        break;
       }
-      else {
-        for (auto y: skipped_elements)  {
-          q.push(y);
-        }
-        skipped_elements.clear();
-        x = temp;
-        return true;
+      // 53 random bits are compared with skip_prob * 2^53, so nothing is merged if skip_prob is 1.
+      if ((random->next() >> 11u) < skip_threshold) {
+        dropped_elements->push_back(x);
+      } else {
+        found = true;
       }
     }
+    // All dropped elements precede the elements left in the buffer.
+    skipped_elements->insert(skipped_elements->end(), dropped_elements->rbegin(),
+                             dropped_elements->rend());
+    return found;
   }
 };
 
-DecodeResult BaseEncoder::encode_sentence(const std::string &sentence_utf8,
-                                          const EncodingConfig &encoding_config,
-                                          OutputType output_type) const {
-  struct NodeDecoder {
-    uint32_t token_id;
-    int prev, next;
-
-    NodeDecoder(uint32_t _val, uint64_t cur_pos)
-        : token_id(_val),
-          prev(static_cast<int>(cur_pos) - 1),
-          next(static_cast<int>(cur_pos) + 1) {}
-
-    NodeDecoder(uint32_t _val, int _prev, int _next)
-        : token_id(_val), prev(_prev), next(_next) {}
-  };
+struct NodeDecoder {
+  uint32_t token_id;
+  int prev, next;
+
+  NodeDecoder(uint32_t _val, uint64_t cur_pos)
+      : token_id(_val),
+        prev(static_cast<int>(cur_pos) - 1),
+        next(static_cast<int>(cur_pos) + 1) {}
+
+  NodeDecoder(uint32_t _val, int _prev, int _next)
+      : token_id(_val), prev(_prev), next(_next) {}
+};
+
+struct MergeEvent2 {
+  int priority;
+  int pos;
+
+  bool operator<(const MergeEvent2 &other) const {
+    return priority > other.priority ||
+        (priority == other.priority && pos > other.pos);
+  }
+};
 
-  struct MergeEvent2 {
-    int priority;
-    int pos;
+// Tokens with ids starting from this value stand for runs of unknown characters.
+const uint32_t UNKNOWN_TOKEN_START = static_cast<uint32_t>(1e9);  // just some number that bigger than any subword id
 
-    bool operator<(const MergeEvent2 &other) const {
-      return priority > other.priority ||
-          (priority == other.priority && pos > other.pos);
+// Buffers larger than this (in elements) are released after a sentence is encoded.
+const uint64_t MAX_SCRATCH_SIZE = 1 << 16;
+
+// Scratch memory of one thread. All buffers keep their capacity between
+// words and sentences, so encoding makes no heap allocations in steady state.
+struct EncodingContext {
+  // code points of the current word
+  std::vector<uint32_t> text;
+  std::vector<NodeDecoder> list;
+  std::vector<MergeEvent2> queue;
+  std::vector<MergeEvent2> skipped;
+  std::vector<MergeEvent2> dropped;
+  DropoutRandom random;
+  std::vector<uint32_t> word_tokens;
+  // words of the current sentence
+  std::vector<WordSpan> spans;
+  // characters of the current word and the state of every sample for multi-sample dropout
+  std::vector<NodeDecoder> word_list;
+  std::vector<DropoutRandom> sample_random;
+  std::vector<std::vector<uint32_t>> sample_tokens;
+  // characters between unknown ones and the state of BacktrackingEncoder
+  std::vector<uint32_t> segment;
+  std::vector<uint8_t> reachable;
+
+  // Tokens of the current sentence. Token UNKNOWN_TOKEN_START + i stands for
+  // the characters unknown_chars[unknown_runs[i].first, unknown_runs[i].second).
+  std::vector<uint32_t> tokens;
+  std::vector<uint32_t> unknown_chars;
+  std::vector<std::pair<uint32_t, uint32_t>> unknown_runs;
+
+  void release_large_buffers() {
+    release_if_large(&text);
+    release_if_large(&list);
+    release_if_large(&queue);
+    release_if_large(&skipped);
+    release_if_large(&dropped);
+    release_if_large(&word_tokens);
+    release_if_large(&spans);
+    release_if_large(&word_list);
+    for (auto &tokens : sample_tokens) {
+      release_if_large(&tokens);
+    }
+    release_if_large(&sample_tokens);
+    release_if_large(&sample_random);
+    release_if_large(&segment);
+    release_if_large(&reachable);
+    release_if_large(&tokens);
+    release_if_large(&unknown_chars);
+    release_if_large(&unknown_runs);
+  }
+
+ private:
+  template<typename T>
+  static void release_if_large(std::vector<T> *buffer) {
+    if (buffer->capacity() > MAX_SCRATCH_SIZE) {
+      std::vector<T>().swap(*buffer);
     }
-  };
+  }
+};
 
-  std::vector<int> output_ids;
-  std::vector<std::string> output_pieces;
+EncodingContext &thread_context() {
+  static thread_local EncodingContext context;
+  return context;
+}
 
-  if (encoding_config.bos) {
-    if (output_type == ID) {
-      output_ids.push_back(bpe_state.special_tokens.bos_id);
-    } else {
-      output_pieces.push_back(BOS_TOKEN);
+template<typename Queue>
+void apply_merges(const RuleTable &rule_table,
+                  const BPE_Rule *rules,
+                  std::vector<NodeDecoder> &list, Queue &queue) {
+  auto push_in_queue_if_rule_exist = [&](uint64_t pos) {
+    int rule_id = rule_table.find(list[pos].token_id, list[list[pos].next].token_id);
+    if (rule_id != -1) {
+      queue.push({rule_id, static_cast<int>(pos)});
     }
+  };
+
+  for (uint64_t j = 0; j + 1 < list.size(); j++) {
+    push_in_queue_if_rule_exist(j);
   }
 
-  std::vector<NodeDecoder> list;
-  flat_hash_map<uint32_t, std::string> unrecognized_tokens;
+  while (true) {
+    MergeEvent2 event;
+    if (!queue.pop(event)) {
+      break;
+    }
+    int rule_id = event.priority;
+    int pos_1 = event.pos;
+    int pos_2 = list[pos_1].next;
+    assert(pos_1 != pos_2);
+    if (list[pos_1].token_id != rules[rule_id].x || pos_2 == -1 ||
+        list[pos_2].token_id != rules[rule_id].y) {
+      continue;
+    }
 
-  auto text = decode_utf8(sentence_utf8.data(),
-                          sentence_utf8.data() + sentence_utf8.size());
+    int pos_0 = list[pos_1].prev;
+    int pos_3 = list[pos_2].next;
 
-  assert(bpe_state.char2id.count(SPACE_TOKEN));
+    list[pos_2] = {0, -1, -1};
+    list[pos_1] = {rules[rule_id].z, pos_0, pos_3};
+    if (pos_3 != -1) {
+      list[pos_3].prev = pos_1;
+    }
 
-  for (; !text.empty() && is_space(text.back()); text.pop_back()) {
+    if (pos_0 != -1) {
+      push_in_queue_if_rule_exist(pos_0);
+    }
+    if (pos_3 != -1) {
+      push_in_queue_if_rule_exist(pos_1);
+    }
   }
+}
+
+// Pairs of tokens with ids below this bound are stored in the dense matrix
+// of RuleTable. Small ids belong to special tokens and the most frequent characters.
+const uint32_t RULE_TABLE_DENSE_SIZE = 128;
 
-  const int new_tokens_start = static_cast<int>(
-      1e9);  // just some number that bigger than any subword id
-  for (auto it_text = text.begin(); it_text != text.end();) {
-    list.clear();
-    unrecognized_tokens.clear();
+void RuleTable::build(const std::vector<BPE_Rule> &rules) {
+  uint32_t max_token = 0;
+  for (const auto &rule : rules) {
+    max_token = std::max(max_token, std::max(rule.x, rule.y));
+  }
+  dense_size = rules.empty() ? 0 : std::min(max_token + 1, RULE_TABLE_DENSE_SIZE);
+  std::vector<int> new_dense(static_cast<uint64_t>(dense_size) * dense_size, -1);
 
-    auto begin_of_word = std::find_if_not(it_text, text.end(), is_space);
-    auto end_of_word = std::find_if(begin_of_word, text.end(), is_space);
-    it_text = end_of_word;
+  uint64_t n_sparse = 0;
+  for (const auto &rule : rules) {
+    n_sparse += rule.x >= dense_size || rule.y >= dense_size;
+  }
+  // The load factor is at most 1/2 and there is always an empty slot.
+  shift = 63;
+  while ((1ull << (64 - shift)) < 2 * n_sparse + 2) {
+    shift--;
+  }
+  std::vector<Slot> new_slots(1ull << (64 - shift), {0, -1, 0});
+  mask = new_slots.size() - 1;
 
-    uint32_t new_token_cur = new_tokens_start;
-    list.emplace_back(bpe_state.char2id.at(SPACE_TOKEN), 0);
+  for (int i = 0; i < (int) rules.size(); i++) {
+    uint32_t x = rules[i].x;
+    uint32_t y = rules[i].y;
+    if (x < dense_size && y < dense_size) {
+      new_dense[x * dense_size + y] = i;
+      continue;
+    }
+    uint64_t key = int2comb(x, y);
+    uint64_t pos = slot_index(key);
+    while (new_slots[pos].rule_id != -1 && new_slots[pos].key != key) {
+      pos = (pos + 1) & mask;
+    }
+    new_slots[pos] = {key, i, 0};
+  }
+  dense.assign(std::move(new_dense));
+  slots.assign(std::move(new_slots));
+}
 
-    for (auto it_char_in_word = begin_of_word; it_char_in_word < end_of_word;) {
-      if (bpe_state.char2id.count(*it_char_in_word) == 0) {
-        auto it_unrecognized_word = std::find_if(
-            it_char_in_word, end_of_word,
-            [&](uint32_t ch) { return bpe_state.char2id.count(ch); });
+// Makes *out refer to a section of a binary model. Sections are aligned to
+// 8 bytes, which is enough for every type stored in them.
+template<typename T>
+bool load_section(const ModelSections &sections, ModelSection section, MappedArray<T> *out) {
+  static_assert(alignof(T) <= 8, "Sections of a model are aligned to 8 bytes");
+  if (sections.size[section] % sizeof(T) != 0) {
+    return false;
+  }
+  out->refer(reinterpret_cast<const T *>(sections.data[section]),
+             sections.size[section] / sizeof(T));
+  return true;
+}
 
-        unrecognized_tokens[new_token_cur] =
-            encode_utf8({it_char_in_word, it_unrecognized_word});
-        it_char_in_word = it_unrecognized_word;
+void RuleTable::dump(ModelSections *sections) const {
+  sections->set(MODEL_RULE_DENSE, dense.data(), dense.size() * sizeof(int));
+  sections->set(MODEL_RULE_SLOTS, slots.data(), slots.size() * sizeof(Slot));
+}
 
-        list.emplace_back(new_token_cur, list.size());
-        new_token_cur++;
-      } else {
-        list.emplace_back(bpe_state.char2id.at(*it_char_in_word), list.size());
-        ++it_char_in_word;
-      }
+Status RuleTable::load(const ModelSections &sections, uint64_t n_rules) {
+  const Status error(1, "Invalid binary model: wrong table of rules");
+  if (!load_section(sections, MODEL_RULE_DENSE, &dense) ||
+      !load_section(sections, MODEL_RULE_SLOTS, &slots)) {
+    return error;
+  }
+  dense_size = 0;
+  while (static_cast<uint64_t>(dense_size + 1) * (dense_size + 1) <= dense.size()) {
+    dense_size++;
+  }
+  if (static_cast<uint64_t>(dense_size) * dense_size != dense.size() ||
+      slots.size() < 2 || (slots.size() & (slots.size() - 1)) != 0) {
+    return error;
+  }
+  mask = slots.size() - 1;
+  // build() makes at least two slots, so shift stays below 64.
+  shift = 64;
+  while ((1ull << (64 - shift)) < slots.size()) {
+    shift--;
+  }
+  auto valid_rule = [&](int rule_id) {
+    return rule_id == -1 || (rule_id >= 0 && static_cast<uint64_t>(rule_id) < n_rules);
+  };
+  bool has_empty_slot = false;
+  for (const auto &slot : slots) {
+    has_empty_slot |= slot.rule_id == -1;
+    if (!valid_rule(slot.rule_id)) {
+      return error;
     }
-    list.back().next = -1;
+  }
+  if (!has_empty_slot || !std::all_of(dense.begin(), dense.end(), valid_rule)) {
+    return error;
+  }
+  return Status();
+}
+
+uint64_t RuleTable::memory() const {
+  return dense.size() * sizeof(int) + slots.size() * sizeof(Slot);
+}
 
+const uint32_t CharTable::NOT_FOUND;
 
-    auto pair_code = [&](uint64_t first_pos) {
-      auto second_pos = list[first_pos].next;
-      return int2comb(list[first_pos].token_id, list[second_pos].token_id);
-    };
+CharTable::CharTable(uint32_t dense_limit) : dense_limit(std::max(dense_limit, 128u)) {}
 
-    std::unique_ptr<BasePriorityQueue<MergeEvent2>> queue(nullptr);
-    if (encoding_config.dropout_prob == 0) {
-      queue.reset(new STLQueue<MergeEvent2>());
+void CharTable::build(const flat_hash_map<uint32_t, uint32_t> &char2id) {
+  uint32_t max_char = 127;
+  for (const auto &x : char2id) {
+    if (x.first < dense_limit) {
+      max_char = std::max(max_char, x.first);
     }
-    else {
-      queue.reset(new DropoutQueue<MergeEvent2>(encoding_config.dropout_prob));
+  }
+  std::vector<uint32_t> new_dense(max_char + 1, NOT_FOUND);
+  std::vector<SparseChar> new_sparse;
+  for (const auto &x : char2id) {
+    if (x.first < new_dense.size()) {
+      new_dense[x.first] = x.second;
+    } else {
+      new_sparse.push_back({x.first, x.second});
     }
+  }
+  std::sort(new_sparse.begin(), new_sparse.end(), [](const SparseChar &a, const SparseChar &b) {
+    return a.code_point < b.code_point;
+  });
+  dense.assign(std::move(new_dense));
+  sparse.assign(std::move(new_sparse));
+}
 
-    auto push_in_queue_if_rule_exist = [&](uint64_t pos) {
-      auto it = rule2id.find(pair_code(pos));
-      if (it != rule2id.end()) {
-        queue->push({it->second, static_cast<int>(pos)});
-      }
-    };
+void CharTable::dump(ModelSections *sections) const {
+  sections->set(MODEL_CHAR_DENSE, dense.data(), dense.size() * sizeof(uint32_t));
+  sections->set(MODEL_CHAR_SPARSE, sparse.data(), sparse.size() * sizeof(SparseChar));
+}
 
-    for (uint64_t j = 0; j + 1 < list.size(); j++) {
-      push_in_queue_if_rule_exist(j);
+Status CharTable::load(const ModelSections &sections, uint64_t n_tokens) {
+  const Status error(1, "Invalid binary model: wrong table of characters");
+  if (!load_section(sections, MODEL_CHAR_DENSE, &dense) || dense.size() < 128 ||
+      !load_section(sections, MODEL_CHAR_SPARSE, &sparse) ||
+      !std::is_sorted(sparse.begin(), sparse.end(), [](const SparseChar &a, const SparseChar &b) {
+        return a.code_point < b.code_point;
+      })) {
+    return error;
+  }
+  for (uint32_t id : dense) {
+    if (id != NOT_FOUND && id >= n_tokens) {
+      return error;
     }
+  }
+  for (const auto &x : sparse) {
+    if (x.id >= n_tokens) {
+      return error;
+    }
+  }
+  return Status();
+}
 
-    while (true) {
-      MergeEvent2 event;
-      if (!queue->pop(event)) {
-        break;
+std::string SubwordView::str() const {
+  return std::string(data, size);
+}
+
+// Applies merge rules to a word in time close to linear in its length. This is
+// the backtracking algorithm from the bpe crate of github.com/github/rust-gems.
+// The word is split from left to right, each time taking the longest token that
+// is a prefix of the rest of the word. A token is accepted only if BPE keeps it
+// next to the previous token (see is_valid_token_pair). Otherwise shorter tokens
+// are tried, and if there are none, the previous token is taken back.
+//
+// The result is the same as with the priority queue if BPE turns the string of
+// every token into this token, and ids of tokens grow with the order of merges.
+// build() returns nullptr for models that don't satisfy this.
+class BacktrackingEncoder {
+ public:
+  static std::unique_ptr<BacktrackingEncoder> build(const BaseEncoder &base) {
+    const BPEState &bpe_state = base.bpe_state;
+    const RuleTable &rule_table = base.rule_table;
+    std::unique_ptr<BacktrackingEncoder> encoder(new BacktrackingEncoder());
+    uint32_t max_char = 0;
+    for (const auto &x : bpe_state.char2id) {
+      max_char = std::max(max_char, x.second);
+    }
+    uint32_t max_token = max_char;
+    for (const auto &rule : bpe_state.rules) {
+      if (rule.z <= max_token) {
+        return nullptr;
       }
-      int rule_id = event.priority;
-      int pos_1 = event.pos;
-      int pos_2 = list[pos_1].next;
-      assert(pos_1 != pos_2);
-      if (list[pos_1].token_id != bpe_state.rules[rule_id].x || pos_2 == -1 ||
-          list[pos_2].token_id != bpe_state.rules[rule_id].y) {
-        continue;
+      max_token = rule.z;
+    }
+
+    encoder->token_len.assign(max_token + 1, 0);
+    encoder->next_prefix.assign(max_token + 1, NO_TOKEN);
+    encoder->split.assign(max_token + 1, {NO_TOKEN, NO_TOKEN});
+    encoder->node_token.assign(1, NO_TOKEN);
+    for (const auto &x : bpe_state.char2id) {
+      encoder->split[x.second] = {x.second, x.second};
+    }
+    for (const auto &rule : bpe_state.rules) {
+      encoder->split[rule.z] = {rule.x, rule.y};
+    }
+    // Characters of the tokens as ids of characters, the characters of token
+    // i are char_ids[char_offsets[i], char_offsets[i + 1]).
+    uint32_t n_tokens = base.vocab_size();
+    std::vector<uint32_t> char_ids;
+    std::vector<uint64_t> char_offsets(n_tokens + 1, 0);
+    for (uint32_t id = 0; id < n_tokens; id++) {
+      for (uint32_t ch : base.token_chars(id)) {
+        char_ids.push_back(base.char_table.find(ch));
       }
+      char_offsets[id + 1] = char_ids.size();
+    }
 
-      int pos_0 = list[pos_1].prev;
-      int pos_3 = list[pos_2].next;
-
-      list[pos_2] = {0, -1, -1};
-      list[pos_1] = {bpe_state.rules[rule_id].z, pos_0, pos_3};
-      if (pos_3 != -1) {
-        list[pos_3].prev = pos_1;
+    // Shorter tokens are inserted first, so nodes close to the root get small
+    // ids and their edges are stored in the dense part of the RuleTable.
+    std::vector<std::pair<uint64_t, uint32_t>> tokens_by_len;
+    for (uint32_t id = 0; id < n_tokens; id++) {
+      if (char_offsets[id + 1] > char_offsets[id]) {
+        tokens_by_len.emplace_back(char_offsets[id + 1] - char_offsets[id], id);
+      }
+    }
+    std::sort(tokens_by_len.begin(), tokens_by_len.end());
+    flat_hash_map<uint64_t, uint32_t> children;
+    std::vector<BPE_Rule> edges;
+    for (const auto &x : tokens_by_len) {
+      uint32_t node = 0;
+      for (uint64_t i = char_offsets[x.second]; i < char_offsets[x.second + 1]; i++) {
+        uint32_t ch = char_ids[i];
+        uint64_t key = (static_cast<uint64_t>(node) << 32u) + ch;
+        auto it = children.find(key);
+        if (it == children.end()) {
+          edges.emplace_back(node, ch, 0);
+          it = children.emplace(key, edges.size()).first;
+          encoder->node_token.push_back(NO_TOKEN);
+        }
+        node = it->second;
       }
+      if (encoder->node_token[node] != NO_TOKEN) {
+        return nullptr;
+      }
+      encoder->node_token[node] = x.second;
+      encoder->token_len[x.second] = x.first;
+    }
+    encoder->edges.build(edges);
+    for (const auto &x : tokens_by_len) {
+      const uint32_t *chars = char_ids.data() + char_offsets[x.second];
+      encoder->next_prefix[x.second] = encoder->longest_match(chars, chars + x.first - 1);
+    }
 
-      if (pos_0 != -1) {
-        push_in_queue_if_rule_exist(pos_0);
+    for (const auto &rule : bpe_state.rules) {
+      if (!encoder->is_valid_token_pair(rule_table, bpe_state.rules.data(), rule.x, rule.y, rule.z)) {
+        return nullptr;
       }
-      if (pos_3 != -1) {
-        push_in_queue_if_rule_exist(pos_1);
+    }
+    return encoder;
+  }
+
+  // Appends tokens of the characters [begin, end) to *tokens.
+  void encode(const uint32_t *begin, const uint32_t *end, const RuleTable &rule_table,
+              const BPE_Rule *rules, std::vector<uint32_t> *tokens,
+              std::vector<uint8_t> *reachable) const {
+    // reachable[i] is cleared if no valid sequence of tokens starts at position i.
+    reachable->assign(end - begin + 1, 1);
+    uint64_t first_token = tokens->size();
+    uint64_t pos = 0;
+    uint32_t next_token = longest_match(begin, end);
+    while (next_token != NO_TOKEN) {
+      uint32_t token = next_token;
+      uint32_t last = tokens->size() > first_token ? tokens->back() : NO_TOKEN;
+      while (true) {
+        uint64_t end_pos = pos + token_len[token];
+        if ((*reachable)[end_pos] &&
+            (last == NO_TOKEN || is_valid_token_pair(rule_table, rules, last, token, NO_TOKEN))) {
+          tokens->push_back(token);
+          pos = end_pos;
+          next_token = longest_match(begin + pos, end);
+          break;
+        }
+        if (next_prefix[token] != NO_TOKEN) {
+          token = next_prefix[token];
+          continue;
+        }
+        assert(last != NO_TOKEN);
+        (*reachable)[pos] = 0;
+        tokens->pop_back();
+        pos -= token_len[last];
+        next_token = last;
+        break;
       }
     }
+  }
 
-    auto it_alive_token = std::find_if(
-        list.begin(), list.end(),
-        [](const NodeDecoder &node) { return node.token_id != 0; });
+ private:
+  // Trie of the strings of tokens. Edge i leads to the node i + 1, edges.find(node, ch)
+  // gives the edge going from the node by the character.
+  RuleTable edges;
+  std::vector<uint32_t> node_token;
+  // Following vectors are indexed by token id.
+  std::vector<uint32_t> token_len;
+  // The longest token that is a proper prefix of the token.
+  std::vector<uint32_t> next_prefix;
+  // Tokens merged into the token, (x, x) for characters.
+  std::vector<std::pair<uint32_t, uint32_t>> split;
+
+  // Returns the longest token that is a prefix of [begin, end), or NO_TOKEN if begin == end.
+  uint32_t longest_match(const uint32_t *begin, const uint32_t *end) const {
+    uint32_t node = 0;
+    uint32_t token = NO_TOKEN;
+    for (; begin != end; begin++) {
+      int edge = edges.find(node, *begin);
+      if (edge == -1) {
+        break;
+      }
+      node = edge + 1;
+      if (node_token[node] != NO_TOKEN) {
+        token = node_token[node];
+      }
+    }
+    return token;
+  }
 
-    assert(it_alive_token != list.end());
-    int alive_token = std::distance(list.begin(), it_alive_token);
-    for (; alive_token != -1; alive_token = list[alive_token].next) {
-      int token_id = list[alive_token].token_id;
-      if (token_id >= new_tokens_start) {
-        if (output_type == ID) {
-          output_ids.push_back(bpe_state.special_tokens.unk_id);
-        } else {
-          assert(unrecognized_tokens.count(token_id));
-          output_pieces.push_back(unrecognized_tokens[token_id]);
+  // Checks that BPE applied to the string of left + right gives exactly these
+  // two tokens. Merges are undone in reverse order, and at each step we check
+  // that no rule applied earlier could have merged tokens across the border.
+  // Only rules producing tokens below max_token are taken into account.
+  bool is_valid_token_pair(const RuleTable &rule_table, const BPE_Rule *rules,
+                           uint32_t left, uint32_t right, uint32_t max_token) const {
+    uint32_t limit = NO_TOKEN;
+    while (true) {
+      int rule_id = rule_table.find(left, right);
+      if (rule_id != -1 && rules[rule_id].z < std::min(limit, max_token)) {
+        return false;
+      }
+      if (left > right) {
+        limit = left;
+        left = split[left].second;
+        if (left == limit) {
+          limit = right + 1;
+          right = split[right].first;
+          if (right + 1 == limit) {
+            return true;
+          }
         }
       } else {
-        if (output_type == ID) {
-          output_ids.push_back(token_id);
-        } else {
-          assert(recipe.count(token_id));
-          output_pieces.push_back(token2word(recipe.at(token_id), id2char));
+        limit = right + 1;
+        right = split[right].first;
+        if (right + 1 == limit) {
+          limit = left;
+          left = split[left].second;
+          if (left == limit) {
+            return true;
+          }
         }
       }
     }
   }
-  if (encoding_config.eos) {
-    if (output_type == ID) {
-      output_ids.push_back(bpe_state.special_tokens.eos_id);
-    } else {
-      output_pieces.push_back(EOS_TOKEN);
+};
+
+EncoderConfig::EncoderConfig(uint64_t cache_size) : cache_size(cache_size) {}
+
+class WordCache {
+ public:
+  explicit WordCache(uint64_t memory_limit)
+      : shards(N_SHARDS), shard_limit(memory_limit / N_SHARDS) {}
+
+  // Appends tokens of the word to *tokens if the word is in the cache.
+  bool lookup(const char *begin, const char *end, std::vector<uint32_t> *tokens) {
+    uint64_t hash = word_hash(begin, end);
+    Shard &shard = shards[hash % N_SHARDS];
+    std::lock_guard<std::mutex> lg(shard.mt);
+    auto it = shard.index.find(hash);
+    if (it == shard.index.end() || !shard.slots[it->second].same_word(begin, end)) {
+      shard.misses++;
+      return false;
     }
+    Entry &entry = shard.slots[it->second];
+    entry.referenced = true;
+    tokens->insert(tokens->end(), entry.tokens.begin(), entry.tokens.end());
+    shard.hits++;
+    return true;
   }
 
-  if (encoding_config.reverse) {
-    if (output_type == ID) {
-      std::reverse(output_ids.begin(), output_ids.end());
+  void insert(const char *begin, const char *end, const std::vector<uint32_t> &tokens) {
+    uint64_t hash = word_hash(begin, end);
+    uint64_t cost = entry_cost(end - begin, tokens.size());
+    Shard &shard = shards[hash % N_SHARDS];
+    if (cost > shard_limit) {
+      return;
+    }
+    std::lock_guard<std::mutex> lg(shard.mt);
+    if (shard.index.count(hash)) {
+      return;
+    }
+    while (shard.memory + cost > shard_limit) {
+      evict(&shard);
+    }
+    uint32_t slot;
+    if (!shard.free_slots.empty()) {
+      slot = shard.free_slots.back();
+      shard.free_slots.pop_back();
     } else {
-      std::reverse(output_pieces.begin(), output_pieces.end());
+      slot = shard.slots.size();
+      shard.slots.emplace_back();
+    }
+    Entry &entry = shard.slots[slot];
+    entry.word.assign(begin, end);
+    entry.tokens = tokens;
+    entry.hash = hash;
+    entry.cost = cost;
+    entry.referenced = false;
+    entry.alive = true;
+    shard.index[hash] = slot;
+    shard.memory += cost;
+  }
+
+  CacheStats stats() const {
+    CacheStats ret;
+    for (const auto &shard : shards) {
+      std::lock_guard<std::mutex> lg(shard.mt);
+      ret.hits += shard.hits;
+      ret.misses += shard.misses;
+      ret.entries += shard.index.size();
+      ret.memory += shard.memory;
     }
+    return ret;
   }
-  return {output_ids, output_pieces};
-}
 
-BaseEncoder::BaseEncoder(BPEState _bpe_state, int _n_threads)
-    : bpe_state(std::move(_bpe_state)), n_threads(_n_threads) {
-  fill_from_state();
-  assert(n_threads >= 1 || n_threads == -1);
-  if (n_threads == -1) {
-    n_threads = std::max(1, int(std::thread::hardware_concurrency()));
-  }
-}
+ private:
+  constexpr static uint64_t N_SHARDS = 64;
 
-BaseEncoder::BaseEncoder(const std::string &model_path, int _n_threads, Status *ret_status)
-    : n_threads(_n_threads) {
-  Status status = bpe_state.load(model_path);
-  if (!status.ok()) {
-    *ret_status = status;
-    return;
-  }
-  fill_from_state();
-  assert(n_threads >= 1 || n_threads == -1);
-  if (n_threads == -1) {
-    n_threads = std::max(1, int(std::thread::hardware_concurrency()));
-  }
-  *ret_status = Status();
-}
+  struct Entry {
+    std::string word;
+    std::vector<uint32_t> tokens;
+    uint64_t hash{0};
+    uint64_t cost{0};
+    bool referenced{false};
+    bool alive{false};
 
-template<typename T>
-std::vector<T> concat_vectors(const std::vector<T> &a, const std::vector<T> &b) {
-  std::vector<T> c;
-  c.reserve(a.size() + b.size());
-  c.insert(c.end(), a.begin(), a.end());
-  c.insert(c.end(), b.begin(), b.end());
-  return c;
-}
+    bool same_word(const char *begin, const char *end) const {
+      return word.size() == static_cast<uint64_t>(end - begin) &&
+          std::equal(begin, end, word.begin());
+    }
+  };
 
-void BaseEncoder::fill_from_state() {
-  for (auto x : bpe_state.char2id) {
-    id2char[x.second] = x.first;
-  }
+  // Entries of a shard are evicted in CLOCK order: the hand skips (and clears)
+  // entries that were hit since the last pass and evicts the first one that was not.
+  struct Shard {
+    mutable std::mutex mt;
+    flat_hash_map<uint64_t, uint32_t> index;
+    std::vector<Entry> slots;
+    std::vector<uint32_t> free_slots;
+    uint64_t hand{0};
+    uint64_t memory{0};
+    uint64_t hits{0};
+    uint64_t misses{0};
+  };
 
-  for (int i = 0; i < (int) bpe_state.rules.size(); i++) {
-    rule2id[int2comb(bpe_state.rules[i].x, bpe_state.rules[i].y)] = i;
+  std::vector<Shard> shards;
+  uint64_t shard_limit;
+
+  static uint64_t word_hash(const char *begin, const char *end) {
+    uint64_t hash = 14695981039346656037ull;
+    for (; begin != end; begin++) {
+      hash = (hash ^ static_cast<uint8_t>(*begin)) * 1099511628211ull;
+    }
+    return hash;
   }
 
-  for (auto x : id2char) {
-    recipe[x.first] = {x.first};
+  static uint64_t entry_cost(uint64_t word_len, uint64_t n_tokens) {
+    return sizeof(Entry) + word_len + n_tokens * sizeof(uint32_t) + 2 * sizeof(uint64_t);
   }
 
-  for (auto rule : bpe_state.rules) {
-    recipe[rule.z] = concat_vectors(recipe[rule.x], recipe[rule.y]);
+  static void evict(Shard *shard) {
+    assert(!shard->index.empty());
+    while (true) {
+      if (shard->hand >= shard->slots.size()) {
+        shard->hand = 0;
+      }
+      Entry &entry = shard->slots[shard->hand++];
+      if (!entry.alive) {
+        continue;
+      }
+      if (entry.referenced) {
+        entry.referenced = false;
+        continue;
+      }
+      shard->index.erase(entry.hash);
+      shard->memory -= entry.cost;
+      shard->free_slots.push_back(shard->hand - 1);
+      entry.alive = false;
+      return;
+    }
   }
+};
 
-  for (const auto &id_to_recipe : recipe) {
-    reversed_recipe[token2word(id_to_recipe.second, id2char)] =
-        id_to_recipe.first;
+bool is_ascii(const char *begin, const char *end) {
+  uint8_t mask = 0;
+  for (; begin != end; begin++) {
+    mask |= static_cast<uint8_t>(*begin);
   }
-  reversed_recipe[BOS_TOKEN] = bpe_state.special_tokens.bos_id;
-  reversed_recipe[EOS_TOKEN] = bpe_state.special_tokens.eos_id;
+  return mask < 128;
 }
 
-int BaseEncoder::vocab_size() const {
-  return bpe_state.rules.size() + bpe_state.char2id.size() +
-      bpe_state.special_tokens.n_special_tokens();
+uint32_t find_char(const CharTable &char_table, uint8_t ch) {
+  return char_table.find_ascii(ch);
 }
 
-Status BaseEncoder::encode_parallel(
-    const std::vector<std::string> &sentences,
-    const EncodingConfig &encoding_config, OutputType output_type,
-    std::vector<DecodeResult> *decoder_results
-) const {
-  if (encoding_config.bos && bpe_state.special_tokens.bos_id == -1) {
-    return Status(1, "Can't add <BOS> token. Model was trained without it.");
-  }
-  if (encoding_config.eos && bpe_state.special_tokens.eos_id == -1) {
-    return Status(1, "Can't add <EOS> token. Model was trained without it.");
-  }
+uint32_t find_char(const CharTable &char_table, uint32_t ch) {
+  return char_table.find(ch);
+}
 
-  decoder_results->assign(sentences.size(), DecodeResult());
-  if (sentences.size() <= static_cast<uint64_t>(n_threads) * 3 ||
-      n_threads == 1) {  // Not too many sentences. It's better to solve it
-    // without threads.
-    for (uint64_t i = 0; i < sentences.size(); i++) {
-      decoder_results->at(i) = encode_sentence(sentences[i], encoding_config, output_type);
+// Appends characters of the word to ctx->list. Runs of characters unknown to
+// the model become single tokens. Returns true if there were such characters.
+template<typename Char>
+bool BaseEncoder::append_chars(const Char *begin, const Char *end, EncodingContext *ctx) const {
+  bool has_unknown = false;
+  for (const Char *it = begin; it != end;) {
+    uint32_t char_id = find_char(char_table, *it);
+    if (char_id != CharTable::NOT_FOUND) {
+      ctx->list.emplace_back(char_id, ctx->list.size());
+      ++it;
+      continue;
+    }
+    const Char *end_of_run = std::find_if(it, end, [&](Char ch) {
+      return char_table.find(ch) != CharTable::NOT_FOUND;
+    });
+    uint32_t run_begin = ctx->unknown_chars.size();
+    ctx->unknown_chars.insert(ctx->unknown_chars.end(), it, end_of_run);
+    ctx->list.emplace_back(UNKNOWN_TOKEN_START + ctx->unknown_runs.size(), ctx->list.size());
+    ctx->unknown_runs.emplace_back(run_begin, ctx->unknown_chars.size());
+    it = end_of_run;
+    has_unknown = true;
+  }
+  return has_unknown;
+}
+
+bool BaseEncoder::prepare_word(const char *begin, const char *end, bool *has_unknown,
+                               bool *invalid_input, EncodingContext *ctx) const {
+  uint32_t space_id = char_table.find(SPACE_TOKEN);
+  assert(space_id != CharTable::NOT_FOUND);
+  std::vector<NodeDecoder> &list = ctx->list;
+  list.clear();
+  list.emplace_back(space_id, 0);
+  if (is_ascii(begin, end)) {
+    *has_unknown = append_chars(reinterpret_cast<const uint8_t *>(begin),
+                                reinterpret_cast<const uint8_t *>(end), ctx);
+  } else {
+    std::vector<uint32_t> &text = ctx->text;
+    text.clear();
+    *invalid_input |= !decode_utf8(begin, end, &text);
+    if (text.empty()) {
+      return false;
     }
-    return Status();
-  }
-  std::vector<std::thread> threads;
-  for (int i = 0; i < n_threads; i++) {
-    threads.emplace_back(
-        [&](uint64_t this_thread) {
-          uint64_t tasks_for_thread =
-              (sentences.size() + n_threads - 1) / n_threads;
-          uint64_t first_task = tasks_for_thread * this_thread;
-          uint64_t last_task =
-              std::min(tasks_for_thread * (this_thread + 1), static_cast<uint64_t>(sentences.size()));
-          for (uint64_t j = first_task; j < last_task; j++) {
-            decoder_results->at(j) =
-                encode_sentence(sentences[j], encoding_config, output_type);
-          }
-        },
-        i);
-  }
-  for (auto &thread : threads) {
-    thread.join();
+    *has_unknown = append_chars(text.data(), text.data() + text.size(), ctx);
   }
-  return Status();
+  list.back().next = -1;
+  return true;
 }
 
-Status BaseEncoder::encode_as_ids(const std::vector<std::string> &sentences, std::vector<std::vector<int>> *ids,
-                                  bool bos, bool eos,
-                                  bool reverse, double dropout_prob) const {
-  EncodingConfig encoding_config = {bos, eos, reverse, dropout_prob};
-
-  std::vector<DecodeResult> decode_results;
-  Status status = encode_parallel(sentences, encoding_config, ID, &decode_results);
-  if (!status.ok()) {
-    return status;
+void BaseEncoder::merge_word(double dropout_prob, DropoutRandom *random, EncodingContext *ctx,
+                             std::vector<uint32_t> *tokens) const {
+  std::vector<NodeDecoder> &list = ctx->list;
+  if (backtracking && dropout_prob == 0) {
+    // Unknown characters are never merged, so the parts of the word between
+    // them are encoded separately.
+    auto encode_segment = [&]() {
+      backtracking->encode(ctx->segment.data(), ctx->segment.data() + ctx->segment.size(),
+                           rule_table, rules.data(), tokens, &ctx->reachable);
+      ctx->segment.clear();
+    };
+    ctx->segment.clear();
+    for (const auto &node : list) {
+      if (node.token_id >= UNKNOWN_TOKEN_START) {
+        encode_segment();
+        tokens->push_back(node.token_id);
+      } else {
+        ctx->segment.push_back(node.token_id);
+      }
+    }
+    encode_segment();
+    return;
   }
-  ids->assign(decode_results.size(), std::vector<int>());
-  for (uint64_t i = 0; i < decode_results.size(); i++) {
-    ids->at(i) = std::move(decode_results[i].ids);
+  if (dropout_prob == 0) {
+    STLQueue<MergeEvent2> queue(&ctx->queue);
+    apply_merges(rule_table, rules.data(), list, queue);
+  } else {
+    DropoutQueue<MergeEvent2> queue(dropout_prob, random, &ctx->queue, &ctx->skipped,
+                                    &ctx->dropped);
+    apply_merges(rule_table, rules.data(), list, queue);
   }
-  return Status();
-}
 
-Status BaseEncoder::encode_as_subwords(
-    const std::vector<std::string> &sentences,
-    std::vector<std::vector<std::string>> *subwords,
-    bool bos, bool eos, bool reverse, double dropout_prob) const {
-  EncodingConfig encoding_config = {bos, eos, reverse, dropout_prob};
-  std::vector<DecodeResult> decode_results;
-  Status status = encode_parallel(sentences, encoding_config, SUBWORD, &decode_results);
-  if (!status.ok()) {
-    return status;
-  }
-  subwords->assign(decode_results.size(), std::vector<std::string>());
-  for (uint64_t i = 0; i < decode_results.size(); i++) {
-    subwords->at(i) = std::move(decode_results[i].pieces);
+  auto it_alive_token = std::find_if(
+      list.begin(), list.end(),
+      [](const NodeDecoder &node) { return node.token_id != 0; });
+
+  assert(it_alive_token != list.end());
+  int alive_token = std::distance(list.begin(), it_alive_token);
+  for (; alive_token != -1; alive_token = list[alive_token].next) {
+    tokens->push_back(list[alive_token].token_id);
   }
-  return Status();
 }
 
-Status BaseEncoder::id_to_subword(int id, std::string *subword, bool replace_space) const {
-  if (id < 0 || vocab_size() <= id) {
-    return Status(1, "id must be in the range [0, vocab_size - 1]. Current value: vocab_size = " +
-        std::to_string(vocab_size()) +
-        "; id=" + std::to_string(id) + ";");
-  }
-  if (bpe_state.special_tokens.unk_id == id) {
-    *subword = UNK_TOKEN;
-    return Status();
-  }
-  if (bpe_state.special_tokens.pad_id == id) {
-    *subword = PAD_TOKEN;
-    return Status();
-  }
-  if (bpe_state.special_tokens.bos_id == id) {
-    *subword = BOS_TOKEN;
-    return Status();
-  }
-  if (bpe_state.special_tokens.eos_id == id) {
-    *subword = EOS_TOKEN;
-    return Status();
+void BaseEncoder::encode_words(const char *begin, const char *end,
+                               const EncodingConfig &encoding_config, uint64_t sentence_id,
+                               EncodingContext *ctx, uint64_t max_tokens, bool from_end) const {
+  double dropout_prob = encoding_config.dropout_prob;
+  if (dropout_prob != 0) {
+    ctx->random.seed(encoding_config.dropout_seed, sentence_id);
   }
+  ctx->tokens.clear();
+  ctx->unknown_chars.clear();
+  ctx->unknown_runs.clear();
 
-  assert(recipe.count(id));
-  if (replace_space) {
-    auto symbols = recipe.at(id);
-    if (id2char.at(symbols[0]) == SPACE_TOKEN) {
-      *subword = " " + token2word({symbols.begin() + 1, symbols.end()}, id2char);
-      return Status();
+  bool use_cache = cache && dropout_prob == 0;
+  bool invalid_input = false;
+
+  auto encode_word = [&](const WordSpan &span) {
+    if (use_cache && cache->lookup(span.begin, span.end, &ctx->tokens)) {
+      return;
+    }
+    bool has_unknown;
+    if (!prepare_word(span.begin, span.end, &has_unknown, &invalid_input, ctx)) {
+      return;
+    }
+    uint64_t word_start = ctx->tokens.size();
+    merge_word(dropout_prob, &ctx->random, ctx, &ctx->tokens);
+    // Words with unknown characters are not cached: their subwords depend on
+    // the original text.
+    if (use_cache && !has_unknown) {
+      ctx->word_tokens.assign(ctx->tokens.begin() + word_start, ctx->tokens.end());
+      cache->insert(span.begin, span.end, ctx->word_tokens);
+    }
+  };
+
+  if (from_end) {
+    // Words are encoded independently, so the last ones can be encoded first.
+    // Tokens of every word are reversed, and then all tokens are reversed back.
+    ctx->spans.clear();
+    split_words(begin, end, &ctx->spans, std::numeric_limits<uint64_t>::max());
+    for (auto it = ctx->spans.rbegin(); it != ctx->spans.rend() && ctx->tokens.size() < max_tokens;
+         ++it) {
+      uint64_t word_start = ctx->tokens.size();
+      encode_word(*it);
+      std::reverse(ctx->tokens.begin() + word_start, ctx->tokens.end());
+    }
+    std::reverse(ctx->tokens.begin(), ctx->tokens.end());
+  } else {
+    const char *it_text = begin;
+    while (it_text != end && ctx->tokens.size() < max_tokens) {
+      ctx->spans.clear();
+      it_text = split_words(it_text, end, &ctx->spans, WORD_BATCH_SIZE);
+      for (const WordSpan &span : ctx->spans) {
+        if (ctx->tokens.size() >= max_tokens) {
+          break;
+        }
+        encode_word(span);
+      }
+    }
+  }
+  if (invalid_input) {
+    std::cerr << "WARNING Input contains invalid unicode characters."
+              << std::endl;
+  }
+}
+
+void BaseEncoder::encode_word_samples(const char *begin, const char *end,
+                                      const EncodingConfig &encoding_config,
+                                      uint64_t sentence_id, uint64_t n_samples,
+                                      EncodingContext *ctx) const {
+  ctx->sample_random.resize(n_samples);
+  ctx->sample_tokens.resize(n_samples);
+  for (uint64_t k = 0; k < n_samples; k++) {
+    // The same random state as for the sentence at position sentence_id * n_samples + k.
+    ctx->sample_random[k].seed(encoding_config.dropout_seed, sentence_id * n_samples + k);
+    ctx->sample_tokens[k].clear();
+  }
+  ctx->unknown_chars.clear();
+  ctx->unknown_runs.clear();
+  bool invalid_input = false;
+
+  const char *it_text = begin;
+  while (it_text != end) {
+    ctx->spans.clear();
+    it_text = split_words(it_text, end, &ctx->spans, WORD_BATCH_SIZE);
+    for (const WordSpan &span : ctx->spans) {
+      bool has_unknown;
+      if (!prepare_word(span.begin, span.end, &has_unknown, &invalid_input, ctx)) {
+        continue;
+      }
+      // Merges change the list, every sample starts from a copy of the characters.
+      ctx->word_list = ctx->list;
+      for (uint64_t k = 0; k < n_samples; k++) {
+        if (k != 0) {
+          ctx->list = ctx->word_list;
+        }
+        merge_word(encoding_config.dropout_prob, &ctx->sample_random[k], ctx,
+                   &ctx->sample_tokens[k]);
+      }
+    }
+  }
+  if (invalid_input) {
+    std::cerr << "WARNING Input contains invalid unicode characters."
+              << std::endl;
+  }
+}
+
+template<typename IdType>
+void BaseEncoder::append_ids(const std::vector<uint32_t> &tokens,
+                             const EncodingConfig &encoding_config,
+                             std::vector<IdType> *ids) const {
+  uint64_t first = ids->size();
+  if (encoding_config.bos) {
+    ids->push_back(bpe_state.special_tokens.bos_id);
+  }
+  for (uint32_t token_id : tokens) {
+    if (token_id >= UNKNOWN_TOKEN_START) {
+      ids->push_back(bpe_state.special_tokens.unk_id);
+    } else {
+      ids->push_back(token_id);
+    }
+  }
+  if (encoding_config.eos) {
+    ids->push_back(bpe_state.special_tokens.eos_id);
+  }
+  if (encoding_config.reverse) {
+    std::reverse(ids->begin() + first, ids->end());
+  }
+}
+
+template<typename IdType>
+void BaseEncoder::encode_sentence(const char *begin, const char *end,
+                                  const EncodingConfig &encoding_config, uint64_t sentence_id,
+                                  std::vector<IdType> *ids) const {
+  EncodingContext &ctx = thread_context();
+  encode_words(begin, end, encoding_config, sentence_id, &ctx);
+  append_ids(ctx.tokens, encoding_config, ids);
+  ctx.release_large_buffers();
+}
+
+template<typename IdType>
+void BaseEncoder::encode_sentence_fixed(const char *begin, const char *end,
+                                        const EncodingConfig &encoding_config,
+                                        uint64_t sentence_id, uint64_t max_len, bool truncate_left,
+                                        IdType *row, uint64_t *length) const {
+  uint64_t max_tokens = max_len - encoding_config.bos - encoding_config.eos;
+  // With BPE-dropout, the last words are encoded after the first ones, as in encode_as_ids.
+  bool from_end = truncate_left && encoding_config.dropout_prob == 0;
+  bool stop_early = !truncate_left || from_end;
+  EncodingContext &ctx = thread_context();
+  encode_words(begin, end, encoding_config, sentence_id, &ctx,
+               stop_early ? max_tokens : std::numeric_limits<uint64_t>::max(), from_end);
+
+  uint64_t n_tokens = std::min<uint64_t>(ctx.tokens.size(), max_tokens);
+  auto first_token = truncate_left ? ctx.tokens.end() - n_tokens : ctx.tokens.begin();
+  IdType *it = row;
+  if (encoding_config.bos) {
+    *it++ = bpe_state.special_tokens.bos_id;
+  }
+  for (auto token = first_token; token != first_token + n_tokens; ++token) {
+    *it++ = *token >= UNKNOWN_TOKEN_START ? bpe_state.special_tokens.unk_id : *token;
+  }
+  if (encoding_config.eos) {
+    *it++ = bpe_state.special_tokens.eos_id;
+  }
+  if (encoding_config.reverse) {
+    std::reverse(row, it);
+  }
+  *length = it - row;
+  std::fill(it, row + max_len, static_cast<IdType>(bpe_state.special_tokens.pad_id));
+  ctx.release_large_buffers();
+}
+
+template<typename IdType>
+void BaseEncoder::encode_sentence_samples(const char *begin, const char *end,
+                                          const EncodingConfig &encoding_config,
+                                          uint64_t sentence_id, uint64_t n_samples,
+                                          std::vector<IdType> *ids, uint64_t *sample_ends) const {
+  EncodingContext &ctx = thread_context();
+  encode_word_samples(begin, end, encoding_config, sentence_id, n_samples, &ctx);
+  for (uint64_t k = 0; k < n_samples; k++) {
+    append_ids(ctx.sample_tokens[k], encoding_config, ids);
+    sample_ends[k] = ids->size();
+  }
+  ctx.release_large_buffers();
+}
+
+void BaseEncoder::encode_sentence(const char *begin, const char *end,
+                                  const EncodingConfig &encoding_config, uint64_t sentence_id,
+                                  std::vector<std::string> *pieces) const {
+  EncodingContext &ctx = thread_context();
+  encode_words(begin, end, encoding_config, sentence_id, &ctx);
+
+  uint64_t first = pieces->size();
+  if (encoding_config.bos) {
+    pieces->push_back(BOS_TOKEN);
+  }
+  for (uint32_t token_id : ctx.tokens) {
+    if (token_id >= UNKNOWN_TOKEN_START) {
+      auto run = ctx.unknown_runs[token_id - UNKNOWN_TOKEN_START];
+      pieces->push_back(encode_utf8({ctx.unknown_chars.begin() + run.first,
+                                     ctx.unknown_chars.begin() + run.second}));
+    } else {
+      SubwordView subword = piece(token_id);
+      pieces->emplace_back(subword.data, subword.size);
+    }
+  }
+  if (encoding_config.eos) {
+    pieces->push_back(EOS_TOKEN);
+  }
+  if (encoding_config.reverse) {
+    std::reverse(pieces->begin() + first, pieces->end());
+  }
+  ctx.release_large_buffers();
+}
+
+void BaseEncoder::encode_sentence(const char *begin, const char *end,
+                                  const EncodingConfig &encoding_config, uint64_t sentence_id,
+                                  std::vector<SubwordView> *pieces,
+                                  std::deque<std::string> *unknown,
+                                  std::mutex *unknown_mt) const {
+  EncodingContext &ctx = thread_context();
+  encode_words(begin, end, encoding_config, sentence_id, &ctx);
+
+  uint64_t first = pieces->size();
+  if (encoding_config.bos) {
+    pieces->push_back(piece(bpe_state.special_tokens.bos_id));
+  }
+  for (uint32_t token_id : ctx.tokens) {
+    if (token_id >= UNKNOWN_TOKEN_START) {
+      auto run = ctx.unknown_runs[token_id - UNKNOWN_TOKEN_START];
+      std::string run_utf8 = encode_utf8({ctx.unknown_chars.begin() + run.first,
+                                          ctx.unknown_chars.begin() + run.second});
+      std::lock_guard<std::mutex> lg(*unknown_mt);
+      unknown->push_back(std::move(run_utf8));
+      pieces->push_back({unknown->back().data(), unknown->back().size()});
+    } else {
+      pieces->push_back(piece(token_id));
+    }
+  }
+  if (encoding_config.eos) {
+    pieces->push_back(piece(bpe_state.special_tokens.eos_id));
+  }
+  if (encoding_config.reverse) {
+    std::reverse(pieces->begin() + first, pieces->end());
+  }
+  ctx.release_large_buffers();
+}
+
+BaseEncoder::BaseEncoder(BPEState _bpe_state, int _n_threads, const EncoderConfig &config)
+    : bpe_state(std::move(_bpe_state)), char_table(config.dense_char_limit), n_threads(_n_threads) {
+  fill_from_state();
+  if (config.engine == BACKTRACKING) {
+    backtracking = BacktrackingEncoder::build(*this);
+  }
+  if (config.cache_size > 0) {
+    cache.reset(new WordCache(config.cache_size));
+  }
+  assert(n_threads >= 1 || n_threads == -1);
+  if (n_threads == -1) {
+    n_threads = std::max(1, int(std::thread::hardware_concurrency()));
+  }
+  if (n_threads > 1) {
+    thread_pool.reset(new ThreadPool(n_threads));
+  }
+}
+
+BaseEncoder::BaseEncoder(const std::string &model_path, int _n_threads, Status *ret_status,
+                         const EncoderConfig &config)
+    : char_table(config.dense_char_limit), n_threads(_n_threads) {
+  Status status;
+  if (is_binary_model(model_path)) {
+    status = load_binary(model_path);
+  } else {
+    status = bpe_state.load(model_path);
+    if (status.ok()) {
+      fill_from_state();
+    }
+  }
+  if (!status.ok()) {
+    *ret_status = status;
+    return;
+  }
+  if (config.engine == BACKTRACKING) {
+    backtracking = BacktrackingEncoder::build(*this);
+  }
+  if (config.cache_size > 0) {
+    cache.reset(new WordCache(config.cache_size));
+  }
+  assert(n_threads >= 1 || n_threads == -1);
+  if (n_threads == -1) {
+    n_threads = std::max(1, int(std::thread::hardware_concurrency()));
+  }
+  if (n_threads > 1) {
+    thread_pool.reset(new ThreadPool(n_threads));
+  }
+  *ret_status = Status();
+}
+
+BaseEncoder::BaseEncoder(BaseEncoder &&other) noexcept = default;
+
+BaseEncoder::~BaseEncoder() = default;
+
+EncodingEngine BaseEncoder::encoding_engine() const {
+  return backtracking ? BACKTRACKING : PRIORITY_QUEUE;
+}
+
+// Byte-wise order of the strings of tokens.
+bool piece_less(const SubwordView &a, const SubwordView &b) {
+  int cmp = memcmp(a.data, b.data, std::min(a.size, b.size));
+  return cmp < 0 || (cmp == 0 && a.size < b.size);
+}
+
+void BaseEncoder::fill_token_chars() {
+  assert(bpe_state.check().ok());
+  uint64_t n_tokens = vocab_size();
+  std::vector<MergeNode> tree(n_tokens, {NO_TOKEN, NO_TOKEN});
+  std::vector<uint64_t> offsets(n_tokens + 1, 0);
+  for (const auto &x : bpe_state.char2id) {
+    offsets[x.second + 1] = 1;
+  }
+  for (const auto &rule : bpe_state.rules) {
+    tree[rule.z] = {rule.x, rule.y};
+    offsets[rule.z + 1] = offsets[rule.x + 1] + offsets[rule.y + 1];
+  }
+  for (uint64_t id = 0; id < n_tokens; id++) {
+    offsets[id + 1] += offsets[id];
+  }
+
+  // Rules only merge tokens produced before them, so the code points of both
+  // children are in place when a rule is reached.
+  std::vector<uint32_t> pool(offsets[n_tokens]);
+  for (const auto &x : bpe_state.char2id) {
+    pool[offsets[x.second]] = x.first;
+  }
+  for (const auto &rule : bpe_state.rules) {
+    auto it = std::copy(pool.begin() + offsets[rule.x], pool.begin() + offsets[rule.x + 1],
+                        pool.begin() + offsets[rule.z]);
+    std::copy(pool.begin() + offsets[rule.y], pool.begin() + offsets[rule.y + 1], it);
+  }
+  token_char_pool.assign(std::move(pool));
+  token_char_offsets.assign(std::move(offsets));
+  merge_tree.assign(std::move(tree));
+}
+
+void BaseEncoder::fill_from_state() {
+  fill_token_chars();
+  rule_table.build(bpe_state.rules);
+  char_table.build(bpe_state.char2id);
+  rules.refer(bpe_state.rules.data(), bpe_state.rules.size());
+
+  const auto &special_tokens = bpe_state.special_tokens;
+  int n_tokens = vocab_size();
+  std::string pool;
+  std::vector<uint64_t> offsets(n_tokens + 1, 0);
+  for (int id = 0; id < n_tokens; id++) {
+    if (id == special_tokens.unk_id) {
+      pool += UNK_TOKEN;
+    } else if (id == special_tokens.pad_id) {
+      pool += PAD_TOKEN;
+    } else if (id == special_tokens.bos_id) {
+      pool += BOS_TOKEN;
+    } else if (id == special_tokens.eos_id) {
+      pool += EOS_TOKEN;
+    } else {
+      CodePointsView chars = token_chars(id);
+      pool += encode_utf8({chars.begin(), chars.end()});
+    }
+    offsets[id + 1] = pool.size();
+  }
+  piece_pool.assign(std::vector<char>(pool.begin(), pool.end()));
+  piece_offsets.assign(std::move(offsets));
+
+  const char *space_token = "\xE2\x96\x81";
+  pool.clear();
+  offsets.assign(n_tokens + 1, 0);
+  for (int id = 0; id < n_tokens; id++) {
+    SubwordView subword = piece(id);
+    if (subword.size >= 3 && std::equal(subword.data, subword.data + 3, space_token)) {
+      pool += ' ';
+      pool.append(subword.data + 3, subword.size - 3);
+    } else {
+      pool.append(subword.data, subword.size);
+    }
+    offsets[id + 1] = pool.size();
+  }
+  decode_pool.assign(std::vector<char>(pool.begin(), pool.end()));
+  decode_offsets.assign(std::move(offsets));
+
+  std::vector<uint32_t> index;
+  for (int id = 0; id < n_tokens; id++) {
+    if (token_chars(id).size > 0) {
+      index.push_back(id);
+    }
+  }
+  std::sort(index.begin(), index.end(), [&](uint32_t a, uint32_t b) {
+    SubwordView piece_a = piece(a);
+    SubwordView piece_b = piece(b);
+    return piece_less(piece_a, piece_b) || (!piece_less(piece_b, piece_a) && a < b);
+  });
+  piece_index.assign(std::move(index));
+}
+
+Status BaseEncoder::dump_binary(const std::string &path) const {
+  ModelSections sections;
+  rule_table.dump(&sections);
+  char_table.dump(&sections);
+  sections.set(MODEL_PIECE_POOL, piece_pool.data(), piece_pool.size());
+  sections.set(MODEL_PIECE_OFFSETS, piece_offsets.data(),
+               piece_offsets.size() * sizeof(uint64_t));
+  sections.set(MODEL_DECODE_POOL, decode_pool.data(), decode_pool.size());
+  sections.set(MODEL_DECODE_OFFSETS, decode_offsets.data(),
+               decode_offsets.size() * sizeof(uint64_t));
+  sections.set(MODEL_PIECE_INDEX, piece_index.data(), piece_index.size() * sizeof(uint32_t));
+  sections.set(MODEL_TOKEN_CHAR_POOL, token_char_pool.data(),
+               token_char_pool.size() * sizeof(uint32_t));
+  sections.set(MODEL_TOKEN_CHAR_OFFSETS, token_char_offsets.data(),
+               token_char_offsets.size() * sizeof(uint64_t));
+  sections.set(MODEL_MERGE_TREE, merge_tree.data(), merge_tree.size() * sizeof(MergeNode));
+  return bpe_state.dump_binary(path, sections);
+}
+
+// Makes *pool and *offsets refer to a pool of strings or code points of
+// tokens in a binary model.
+template<typename T>
+bool load_pool(const ModelSections &sections, ModelSection pool_section,
+               ModelSection offsets_section, uint64_t n_tokens, MappedArray<T> *pool,
+               MappedArray<uint64_t> *offsets) {
+  if (!load_section(sections, offsets_section, offsets) || offsets->size() != n_tokens + 1 ||
+      (*offsets)[0] != 0 || (*offsets)[n_tokens] * sizeof(T) != sections.size[pool_section] ||
+      !std::is_sorted(offsets->begin(), offsets->end())) {
+    return false;
+  }
+  return load_section(sections, pool_section, pool);
+}
+
+bool BaseEncoder::check_token_chars() const {
+  for (const auto &x : bpe_state.char2id) {
+    CodePointsView chars = token_chars(x.second);
+    const MergeNode &node = merge_tree[x.second];
+    if (chars.size != 1 || chars.data[0] != x.first || node.x != NO_TOKEN || node.y != NO_TOKEN) {
+      return false;
+    }
+  }
+  for (const auto &rule : bpe_state.rules) {
+    CodePointsView chars = token_chars(rule.z);
+    CodePointsView x_chars = token_chars(rule.x);
+    CodePointsView y_chars = token_chars(rule.y);
+    const MergeNode &node = merge_tree[rule.z];
+    if (chars.size != x_chars.size + y_chars.size ||
+        !std::equal(x_chars.begin(), x_chars.end(), chars.begin()) ||
+        !std::equal(y_chars.begin(), y_chars.end(), chars.begin() + x_chars.size) ||
+        node.x != rule.x || node.y != rule.y) {
+      return false;
+    }
+  }
+  // Ids of characters and rules are distinct (see BPEState::check), so the
+  // remaining ids, of special tokens, must have no characters and no children.
+  uint64_t n_with_chars = 0;
+  uint64_t n_with_children = 0;
+  for (uint64_t id = 0; id < merge_tree.size(); id++) {
+    n_with_chars += token_chars(id).size > 0;
+    n_with_children += merge_tree[id].x != NO_TOKEN || merge_tree[id].y != NO_TOKEN;
+  }
+  return n_with_chars == bpe_state.char2id.size() + bpe_state.rules.size() &&
+      n_with_children == bpe_state.rules.size();
+}
+
+Status BaseEncoder::load_binary(const std::string &model_path) {
+  model_file.reset(new MappedFile());
+  Status status = model_file->open(model_path, false);
+  if (!status.ok()) {
+    return Status(1, "Can not open file with model: " + model_path);
+  }
+  ModelSections sections;
+  status = bpe_state.load_binary(model_file->data(), model_file->size(), &sections);
+  if (!status.ok()) {
+    return status;
+  }
+  load_section(sections, MODEL_RULES, &rules);
+  status = rule_table.load(sections, bpe_state.rules.size());
+  if (!status.ok()) {
+    return status;
+  }
+  status = char_table.load(sections, vocab_size());
+  if (!status.ok()) {
+    return status;
+  }
+
+  uint64_t n_tokens = vocab_size();
+  if (!load_pool(sections, MODEL_PIECE_POOL, MODEL_PIECE_OFFSETS, n_tokens, &piece_pool,
+                 &piece_offsets) ||
+      !load_pool(sections, MODEL_DECODE_POOL, MODEL_DECODE_OFFSETS, n_tokens, &decode_pool,
+                 &decode_offsets)) {
+    return Status(1, "Invalid binary model: wrong strings of tokens");
+  }
+  if (!load_pool(sections, MODEL_TOKEN_CHAR_POOL, MODEL_TOKEN_CHAR_OFFSETS, n_tokens,
+                 &token_char_pool, &token_char_offsets) ||
+      !load_section(sections, MODEL_MERGE_TREE, &merge_tree) || merge_tree.size() != n_tokens ||
+      !check_token_chars()) {
+    return Status(1, "Invalid binary model: wrong characters of tokens");
+  }
+  if (!load_section(sections, MODEL_PIECE_INDEX, &piece_index) ||
+      !std::all_of(piece_index.begin(), piece_index.end(),
+                   [&](uint32_t id) { return id < n_tokens; })) {
+    return Status(1, "Invalid binary model: wrong index of tokens");
+  }
+  return Status();
+}
+
+int BaseEncoder::vocab_size() const {
+  return bpe_state.rules.size() + bpe_state.char2id.size() +
+      bpe_state.special_tokens.n_special_tokens();
+}
+
+uint64_t BaseEncoder::model_hash() const {
+  return bpe_state.hash();
+}
+
+Status BaseEncoder::open_dataset(const std::string &path, DatasetWriter *writer) const {
+  uint32_t id_size = vocab_size() <= (1 << 16) ? 2 : 4;
+  return writer->open(path, id_size, model_hash(), bpe_state.special_tokens);
+}
+
+// Batches with less text are encoded by the calling thread only.
+const uint64_t PARALLEL_MIN_BYTES = 8 * 1024;
+const uint64_t MIN_CHUNK_BYTES = 2 * 1024;
+const uint64_t CHUNKS_PER_THREAD = 16;
+
+uint64_t SentenceBatch::total_bytes() const {
+  if (n_sentences == 0) {
+    return 0;
+  }
+  if (offsets) {
+    return offsets[n_sentences] - offsets[0];
+  }
+  uint64_t total = 0;
+  for (uint64_t i = 0; i < n_sentences; i++) {
+    total += (*this)[i].size;
+  }
+  return total;
+}
+
+// Splits n_sentences sentences into consecutive chunks of roughly equal size in
+// bytes (in ids for sentences of ids), sentence_size(i) is the size of the i-th one.
+// Returns the chunk borders: chunk i is [borders[i], borders[i + 1]).
+template<typename SentenceSize>
+std::vector<uint64_t> split_by_bytes(uint64_t n_sentences, const SentenceSize &sentence_size,
+                                     uint64_t total_bytes, int n_threads) {
+  uint64_t chunk_bytes = std::max(MIN_CHUNK_BYTES, total_bytes / (n_threads * CHUNKS_PER_THREAD));
+  std::vector<uint64_t> borders = {0};
+  uint64_t cur_bytes = 0;
+  for (uint64_t i = 0; i < n_sentences; i++) {
+    cur_bytes += sentence_size(i) + 1;
+    if (cur_bytes >= chunk_bytes) {
+      borders.push_back(i + 1);
+      cur_bytes = 0;
+    }
+  }
+  if (borders.back() != n_sentences) {
+    borders.push_back(n_sentences);
+  }
+  return borders;
+}
+
+std::vector<uint64_t> split_by_bytes(const SentenceBatch &sentences, uint64_t total_bytes,
+                                     int n_threads) {
+  return split_by_bytes(
+      sentences.size(), [&](uint64_t i) { return sentences[i].size; }, total_bytes, n_threads);
+}
+
+Status BaseEncoder::check_encoding_config(const EncodingConfig &encoding_config) const {
+  if (encoding_config.bos && bpe_state.special_tokens.bos_id == -1) {
+    return Status(1, "Can't add <BOS> token. Model was trained without it.");
+  }
+  if (encoding_config.eos && bpe_state.special_tokens.eos_id == -1) {
+    return Status(1, "Can't add <EOS> token. Model was trained without it.");
+  }
+  return Status();
+}
+
+void BaseEncoder::run_parallel(uint64_t n_tasks,
+                               const std::function<void(uint64_t)> &task) const {
+  if (thread_pool) {
+    thread_pool->parallel_for(n_tasks, task);
+  } else {
+    for (uint64_t i = 0; i < n_tasks; i++) {
+      task(i);
+    }
+  }
+}
+
+template<typename EncodeFunction>
+void BaseEncoder::encode_parallel(const SentenceBatch &sentences,
+                                  const EncodeFunction &encode) const {
+  uint64_t total_bytes = sentences.total_bytes();
+  if (!thread_pool || total_bytes < PARALLEL_MIN_BYTES) {
+    // Not too much text. It's better to solve it without threads.
+    for (uint64_t i = 0; i < sentences.size(); i++) {
+      encode(i);
+    }
+    return;
+  }
+  auto chunks = split_by_bytes(sentences, total_bytes, n_threads);
+  thread_pool->parallel_for(chunks.size() - 1, [&](uint64_t chunk_id) {
+    for (uint64_t j = chunks[chunk_id]; j < chunks[chunk_id + 1]; j++) {
+      encode(j);
+    }
+  });
+}
+
+template<typename T>
+std::vector<std::string> BaseEncoder::format_parallel(
+    const SentenceBatch &sentences, const std::vector<std::vector<T>> &tokens) const {
+  uint64_t total_bytes = sentences.total_bytes();
+  if (!thread_pool || total_bytes < PARALLEL_MIN_BYTES) {
+    std::vector<std::string> output(1);
+    format_sentences(tokens, 0, tokens.size(), &output[0]);
+    return output;
+  }
+  auto chunks = split_by_bytes(sentences, total_bytes, n_threads);
+  std::vector<std::string> output(chunks.size() - 1);
+  thread_pool->parallel_for(output.size(), [&](uint64_t chunk_id) {
+    format_sentences(tokens, chunks[chunk_id], chunks[chunk_id + 1], &output[chunk_id]);
+  });
+  return output;
+}
+
+Status BaseEncoder::encode_as_ids(const SentenceBatch &sentences, std::vector<std::vector<int>> *ids,
+                                  bool bos, bool eos,
+                                  bool reverse, double dropout_prob, int64_t dropout_seed) const {
+  EncodingConfig encoding_config =
+      make_encoding_config(bos, eos, reverse, dropout_prob, dropout_seed);
+  Status status = check_encoding_config(encoding_config);
+  if (!status.ok()) {
+    return status;
+  }
+  // Vectors of *ids are reused, so repeated calls with the same output do not allocate memory.
+  ids->resize(sentences.size());
+  encode_parallel(sentences, [&](uint64_t i) {
+    std::vector<int> &sentence_ids = (*ids)[i];
+    sentence_ids.clear();
+    SentenceView sentence = sentences[i];
+    encode_sentence(sentence.data, sentence.data + sentence.size, encoding_config, i,
+                    &sentence_ids);
+  });
+  return Status();
+}
+
+template<typename IdType>
+Status BaseEncoder::encode_flat(const SentenceBatch &sentences,
+                                const EncodingConfig &encoding_config, uint64_t n_samples,
+                                std::vector<IdType> *ids, std::vector<uint64_t> *offsets) const {
+  Status status = check_encoding_config(encoding_config);
+  if (!status.ok()) {
+    return status;
+  }
+  if (static_cast<uint64_t>(vocab_size()) - 1 > std::numeric_limits<IdType>::max()) {
+    return Status(1, "Ids don't fit into the output type. Current value of vocab_size = " +
+        std::to_string(vocab_size()));
+  }
+  ids->clear();
+  offsets->assign(sentences.size() * n_samples + 1, 0);
+  // Encodes the j-th sentence into *out and sets the end offsets of its samples,
+  // relative to the start of *out.
+  auto encode_rows = [&](uint64_t j, std::vector<IdType> *out) {
+    const char *begin = sentences[j].data;
+    const char *end = begin + sentences[j].size;
+    if (n_samples == 1) {
+      encode_sentence(begin, end, encoding_config, j, out);
+      (*offsets)[j + 1] = out->size();
+    } else {
+      encode_sentence_samples(begin, end, encoding_config, j, n_samples, out,
+                              offsets->data() + j * n_samples + 1);
+    }
+  };
+  uint64_t total_bytes = sentences.total_bytes();
+  if (!thread_pool || total_bytes * n_samples < PARALLEL_MIN_BYTES) {
+    for (uint64_t i = 0; i < sentences.size(); i++) {
+      encode_rows(i, ids);
     }
+    return Status();
+  }
+
+  // Every chunk is encoded into its own buffer, offsets are relative to the chunk start.
+  auto chunks = split_by_bytes(sentences, total_bytes, n_threads);
+  uint64_t n_chunks = chunks.size() - 1;
+  std::vector<std::vector<IdType>> chunk_ids(n_chunks);
+  thread_pool->parallel_for(n_chunks, [&](uint64_t chunk_id) {
+    for (uint64_t j = chunks[chunk_id]; j < chunks[chunk_id + 1]; j++) {
+      encode_rows(j, &chunk_ids[chunk_id]);
+    }
+  });
+
+  std::vector<uint64_t> chunk_start(n_chunks + 1, 0);
+  for (uint64_t i = 0; i < n_chunks; i++) {
+    chunk_start[i + 1] = chunk_start[i] + chunk_ids[i].size();
+  }
+  ids->resize(chunk_start.back());
+  thread_pool->parallel_for(n_chunks, [&](uint64_t chunk_id) {
+    for (uint64_t row = chunks[chunk_id] * n_samples; row < chunks[chunk_id + 1] * n_samples; row++) {
+      (*offsets)[row + 1] += chunk_start[chunk_id];
+    }
+    std::copy(chunk_ids[chunk_id].begin(), chunk_ids[chunk_id].end(),
+              ids->begin() + chunk_start[chunk_id]);
+    std::vector<IdType>().swap(chunk_ids[chunk_id]);
+  });
+  return Status();
+}
+
+template<typename IdType>
+Status BaseEncoder::encode_padded(const SentenceBatch &sentences,
+                                  const EncodingConfig &encoding_config,
+                                  std::vector<IdType> *matrix, std::vector<uint64_t> *lengths,
+                                  uint64_t *max_len) const {
+  if (bpe_state.special_tokens.pad_id == -1) {
+    return Status(1, "Can't pad sentences. Model was trained without <PAD> token.");
+  }
+  std::vector<IdType> ids;
+  std::vector<uint64_t> offsets;
+  Status status = encode_flat(sentences, encoding_config, 1, &ids, &offsets);
+  if (!status.ok()) {
+    return status;
+  }
+  lengths->resize(sentences.size());
+  *max_len = 0;
+  for (uint64_t i = 0; i < sentences.size(); i++) {
+    (*lengths)[i] = offsets[i + 1] - offsets[i];
+    *max_len = std::max(*max_len, (*lengths)[i]);
+  }
+  matrix->assign(sentences.size() * *max_len, static_cast<IdType>(bpe_state.special_tokens.pad_id));
+  for (uint64_t i = 0; i < sentences.size(); i++) {
+    std::copy(ids.begin() + offsets[i], ids.begin() + offsets[i + 1], matrix->begin() + i * *max_len);
+  }
+  return Status();
+}
+
+Status BaseEncoder::encode_as_ids_flat(
+    const SentenceBatch &sentences, std::vector<int> *ids,
+    std::vector<uint64_t> *offsets, bool bos, bool eos, bool reverse,
+    double dropout_prob, int64_t dropout_seed) const {
+  EncodingConfig encoding_config =
+      make_encoding_config(bos, eos, reverse, dropout_prob, dropout_seed);
+  return encode_flat(sentences, encoding_config, 1, ids, offsets);
+}
+
+Status BaseEncoder::encode_as_ids_flat(
+    const SentenceBatch &sentences, std::vector<uint16_t> *ids,
+    std::vector<uint64_t> *offsets, bool bos, bool eos, bool reverse,
+    double dropout_prob, int64_t dropout_seed) const {
+  EncodingConfig encoding_config =
+      make_encoding_config(bos, eos, reverse, dropout_prob, dropout_seed);
+  return encode_flat(sentences, encoding_config, 1, ids, offsets);
+}
+
+template<typename IdType>
+Status BaseEncoder::encode_fixed(const SentenceBatch &sentences,
+                                 const EncodingConfig &encoding_config, uint64_t max_len,
+                                 bool truncate_left, IdType *matrix, uint64_t *lengths) const {
+  Status status = check_encoding_config(encoding_config);
+  if (!status.ok()) {
+    return status;
+  }
+  if (bpe_state.special_tokens.pad_id == -1) {
+    return Status(1, "Can't pad sentences. Model was trained without <PAD> token.");
   }
-  *subword = token2word(recipe.at(id), id2char);
+  if (static_cast<uint64_t>(vocab_size()) - 1 > std::numeric_limits<IdType>::max()) {
+    return Status(1, "Ids don't fit into the output type. Current value of vocab_size = " +
+        std::to_string(vocab_size()));
+  }
+  if (max_len < static_cast<uint64_t>(encoding_config.bos + encoding_config.eos)) {
+    return Status(1, "max_len is too small for <BOS> and <EOS> tokens. Current value of max_len = " +
+        std::to_string(max_len));
+  }
+  encode_parallel(sentences, [&](uint64_t i) {
+    SentenceView sentence = sentences[i];
+    encode_sentence_fixed(sentence.data, sentence.data + sentence.size, encoding_config, i,
+                          max_len, truncate_left, matrix + i * max_len, lengths + i);
+  });
+  return Status();
+}
+
+Status BaseEncoder::encode_as_ids_fixed(
+    const SentenceBatch &sentences, uint64_t max_len, bool truncate_left,
+    int *matrix, uint64_t *lengths, bool bos, bool eos, bool reverse,
+    double dropout_prob, int64_t dropout_seed) const {
+  EncodingConfig encoding_config =
+      make_encoding_config(bos, eos, reverse, dropout_prob, dropout_seed);
+  return encode_fixed(sentences, encoding_config, max_len, truncate_left, matrix, lengths);
+}
+
+Status BaseEncoder::encode_as_ids_fixed(
+    const SentenceBatch &sentences, uint64_t max_len, bool truncate_left,
+    uint16_t *matrix, uint64_t *lengths, bool bos, bool eos, bool reverse,
+    double dropout_prob, int64_t dropout_seed) const {
+  EncodingConfig encoding_config =
+      make_encoding_config(bos, eos, reverse, dropout_prob, dropout_seed);
+  return encode_fixed(sentences, encoding_config, max_len, truncate_left, matrix, lengths);
+}
+
+Status BaseEncoder::encode_as_ids_samples(
+    const SentenceBatch &sentences, uint64_t n_samples, std::vector<int> *ids,
+    std::vector<uint64_t> *offsets, bool bos, bool eos, bool reverse,
+    double dropout_prob, int64_t dropout_seed) const {
+  if (n_samples == 0) {
+    return Status(1, "n_samples must be positive.");
+  }
+  EncodingConfig encoding_config =
+      make_encoding_config(bos, eos, reverse, dropout_prob, dropout_seed);
+  return encode_flat(sentences, encoding_config, n_samples, ids, offsets);
+}
+
+Status BaseEncoder::encode_as_ids_padded(
+    const SentenceBatch &sentences, std::vector<int> *matrix,
+    std::vector<uint64_t> *lengths, uint64_t *max_len, bool bos, bool eos,
+    bool reverse, double dropout_prob, int64_t dropout_seed) const {
+  EncodingConfig encoding_config =
+      make_encoding_config(bos, eos, reverse, dropout_prob, dropout_seed);
+  return encode_padded(sentences, encoding_config, matrix, lengths, max_len);
+}
+
+Status BaseEncoder::encode_as_ids_padded(
+    const SentenceBatch &sentences, std::vector<uint16_t> *matrix,
+    std::vector<uint64_t> *lengths, uint64_t *max_len, bool bos, bool eos,
+    bool reverse, double dropout_prob, int64_t dropout_seed) const {
+  EncodingConfig encoding_config =
+      make_encoding_config(bos, eos, reverse, dropout_prob, dropout_seed);
+  return encode_padded(sentences, encoding_config, matrix, lengths, max_len);
+}
+
+Status BaseEncoder::encode_as_subwords(
+    const SentenceBatch &sentences,
+    std::vector<std::vector<std::string>> *subwords,
+    bool bos, bool eos, bool reverse, double dropout_prob, int64_t dropout_seed) const {
+  EncodingConfig encoding_config =
+      make_encoding_config(bos, eos, reverse, dropout_prob, dropout_seed);
+  Status status = check_encoding_config(encoding_config);
+  if (!status.ok()) {
+    return status;
+  }
+  subwords->resize(sentences.size());
+  encode_parallel(sentences, [&](uint64_t i) {
+    std::vector<std::string> &sentence_subwords = (*subwords)[i];
+    sentence_subwords.clear();
+    SentenceView sentence = sentences[i];
+    encode_sentence(sentence.data, sentence.data + sentence.size, encoding_config, i,
+                    &sentence_subwords);
+  });
+  return Status();
+}
+
+Status BaseEncoder::encode_as_subword_views(
+    const SentenceBatch &sentences, SubwordViews *subwords,
+    bool bos, bool eos, bool reverse, double dropout_prob, int64_t dropout_seed) const {
+  EncodingConfig encoding_config =
+      make_encoding_config(bos, eos, reverse, dropout_prob, dropout_seed);
+  Status status = check_encoding_config(encoding_config);
+  if (!status.ok()) {
+    return status;
+  }
+  subwords->pieces.resize(sentences.size());
+  subwords->unknown.clear();
+  std::mutex unknown_mt;
+  encode_parallel(sentences, [&](uint64_t i) {
+    std::vector<SubwordView> &sentence_subwords = subwords->pieces[i];
+    sentence_subwords.clear();
+    SentenceView sentence = sentences[i];
+    encode_sentence(sentence.data, sentence.data + sentence.size, encoding_config, i,
+                    &sentence_subwords, &subwords->unknown, &unknown_mt);
+  });
+  return Status();
+}
+
+Status BaseEncoder::id_to_subword(int id, std::string *subword, bool replace_space) const {
+  if (id < 0 || vocab_size() <= id) {
+    return Status(1, "id must be in the range [0, vocab_size - 1]. Current value: vocab_size = " +
+        std::to_string(vocab_size()) +
+        "; id=" + std::to_string(id) + ";");
+  }
+  SubwordView subword_view = piece(id);
+  if (replace_space && subword_view.size >= 3 &&
+      std::equal(subword_view.data, subword_view.data + 3, "\xE2\x96\x81")) {
+    // The string of the token starts with SPACE_TOKEN.
+    *subword = " ";
+    subword->append(subword_view.data + 3, subword_view.size - 3);
+    return Status();
+  }
+  subword->assign(subword_view.data, subword_view.size);
   return Status();
 }
 
@@ -1819,60 +3147,149 @@ int BaseEncoder::subword_to_id(const std::string &token) const {
   if (EOS_TOKEN == token) {
     return bpe_state.special_tokens.eos_id;
   }
-  if (reversed_recipe.count(token)) {
-    return reversed_recipe.at(token);
+  SubwordView key = {token.data(), token.size()};
+  auto it = std::lower_bound(piece_index.begin(), piece_index.end(), key,
+                             [&](uint32_t id, const SubwordView &value) {
+                               return piece_less(piece(id), value);
+                             });
+  if (it != piece_index.end() && !piece_less(key, piece(*it))) {
+    return *it;
   }
   return bpe_state.special_tokens.unk_id;
 }
 
+std::vector<uint64_t> BaseEncoder::ignore_bitmap(
+    const std::unordered_set<int> *ignore_ids) const {
+  std::vector<uint64_t> bitmap;
+  if (!ignore_ids || ignore_ids->empty()) {
+    return bitmap;
+  }
+  uint64_t n_tokens = vocab_size();
+  bitmap.assign(n_tokens / 64 + 1, 0);
+  for (int id : *ignore_ids) {
+    if (0 <= id && static_cast<uint64_t>(id) < n_tokens) {
+      bitmap[id / 64] |= uint64_t(1) << (id % 64);
+    }
+  }
+  return bitmap;
+}
+
+Status BaseEncoder::decode_ids(const int *begin, const int *end,
+                               const std::vector<uint64_t> &ignored,
+                               const std::unordered_set<int> *ignore_ids,
+                               std::string *sentence) const {
+  uint64_t n_tokens = decode_offsets.size() - 1;
+  bool check_set = ignored.empty() && ignore_ids && !ignore_ids->empty();
+  auto skip = [&](int id) {
+    if (!ignored.empty() && static_cast<uint64_t>(id) < n_tokens) {
+      return ((ignored[id / 64] >> (id % 64)) & 1) != 0;
+    }
+    return (check_set || !ignored.empty()) && ignore_ids->count(id) != 0;
+  };
+
+  // The leading space of the first token is not a separator
+  uint64_t length = 0;
+  bool first_token = true;
+  for (const int *it = begin; it != end; ++it) {
+    int id = *it;
+    if (skip(id)) {
+      continue;
+    }
+    if (static_cast<uint64_t>(id) >= n_tokens) {
+      std::string subword;
+      return id_to_subword(id, &subword);
+    }
+    uint64_t token_length = decode_offsets[id + 1] - decode_offsets[id];
+    length += token_length;
+    if (first_token && token_length > 0 && decode_pool[decode_offsets[id]] == ' ') {
+      length--;
+    }
+    first_token = false;
+  }
+
+  uint64_t first = sentence->size();
+  sentence->resize(first + length);
+  char *out = &(*sentence)[0] + first;
+  first_token = true;
+  for (const int *it = begin; it != end; ++it) {
+    int id = *it;
+    if (skip(id)) {
+      continue;
+    }
+    uint64_t token_begin = decode_offsets[id];
+    if (first_token && token_begin < decode_offsets[id + 1] && decode_pool[token_begin] == ' ') {
+      token_begin++;
+    }
+    first_token = false;
+    memcpy(out, decode_pool.data() + token_begin, decode_offsets[id + 1] - token_begin);
+    out += decode_offsets[id + 1] - token_begin;
+  }
+  return Status();
+}
+
 Status BaseEncoder::decode(const std::vector<std::vector<int>> &ids,
                            std::vector<std::string> *sentences,
                            const std::unordered_set<int> *ignore_ids) const {
-  std::vector<std::string> ret;
+  std::vector<uint64_t> ignored = ignore_bitmap(ignore_ids);
+  uint64_t first = sentences->size();
+  sentences->resize(first + ids.size());
+  auto decode_range = [&](uint64_t begin, uint64_t end, Status *status, uint64_t *failed) {
+    for (uint64_t i = begin; i < end; i++) {
+      std::string &sentence = (*sentences)[first + i];
+      sentence.clear();
+      *status = decode_ids(ids[i].data(), ids[i].data() + ids[i].size(), ignored, ignore_ids,
+                           &sentence);
+      if (!status->ok()) {
+        *failed = i;
+        return;
+      }
+    }
+  };
+
+  uint64_t total_ids = 0;
   for (const auto &sentence : ids) {
-    std::string decode_output;
-    Status status = decode(sentence, &decode_output, ignore_ids);
-    if (!status.ok()) {
-      return status;
+    total_ids += sentence.size();
+  }
+  Status status;
+  uint64_t failed = ids.size();
+  if (!thread_pool || total_ids < PARALLEL_MIN_BYTES) {
+    decode_range(0, ids.size(), &status, &failed);
+  } else {
+    auto chunks = split_by_bytes(
+        ids.size(), [&](uint64_t i) { return ids[i].size(); }, total_ids, n_threads);
+    uint64_t n_chunks = chunks.size() - 1;
+    std::vector<Status> statuses(n_chunks);
+    std::vector<uint64_t> failed_ids(n_chunks, ids.size());
+    thread_pool->parallel_for(n_chunks, [&](uint64_t k) {
+      decode_range(chunks[k], chunks[k + 1], &statuses[k], &failed_ids[k]);
+    });
+    for (uint64_t k = 0; k < n_chunks && status.ok(); k++) {
+      status = statuses[k];
+      failed = failed_ids[k];
     }
-    sentences->push_back(std::move(decode_output));
   }
-  return Status();
+  if (!status.ok()) {
+    // The sentences before the first invalid one are kept
+    sentences->resize(first + failed);
+  }
+  return status;
 }
 
 Status BaseEncoder::decode(const std::vector<int> &ids, std::string *sentence, const std::unordered_set<int> *ignore_ids) const {
-  bool first_iter = true;
-  for (auto id : ids) {
-    std::string subword;
-
-    if (!ignore_ids || ignore_ids->count(id) == 0) {
-      Status status = id_to_subword(id, &subword, true);
-      if (!status.ok()) {
-        return status;
-      }
-      *sentence += subword;
-      if (first_iter && sentence->at(0) == ' ') {
-        *sentence = sentence->substr(1);
-      }
-      first_iter = false;
-    }
-  }
-  return Status();
+  return decode_ids(ids.data(), ids.data() + ids.size(), {}, ignore_ids, sentence);
 }
 
 Status BaseEncoder::decode(const std::vector<std::string> &data,
                            std::vector<std::string> *sentences,
                            const std::unordered_set<int> *ignore_ids) const {
+  std::vector<uint64_t> ignored = ignore_bitmap(ignore_ids);
+  std::vector<int> ids;
   for (const auto &s : data) {
-    std::stringstream stream;
-    stream << s;
-    std::vector<int> ids;
-    int x;
-    while (stream >> x) {
-      ids.push_back(x);
-    }
+    ids.clear();
+    parse_ints(s.data(), s.data() + s.size(), &ids);
     std::string sentence;
-    Status status = decode(ids, &sentence, ignore_ids);
+    Status status = decode_ids(ids.data(), ids.data() + ids.size(), ignored, ignore_ids,
+                               &sentence);
     if (!status.ok()) {
       return status;
     }
@@ -1885,43 +3302,27 @@ std::vector<std::string> BaseEncoder::vocabulary() const {
   int n = vocab_size();
   std::vector<std::string> vocab(n);
   for (int i = 0; i < n; i++) {
-    std::string subword;
-    Status status = id_to_subword(i, &subword);
-    assert(status.ok());
-    vocab[i] = subword;
+    vocab[i] = piece(i).str();
   }
   return vocab;
 }
 
 void BaseEncoder::vocab_cli(bool verbose) const {
-  uint32_t n_tokens = 0;
-  for (const auto &entry : recipe) {
-    n_tokens = std::max(entry.first, n_tokens);
-  }
-  n_tokens = std::max(n_tokens, bpe_state.special_tokens.max_id());
-  n_tokens++;
-
-  flat_hash_map<uint32_t, std::pair<uint32_t, uint32_t>> reversed_rules;
-  if (verbose) {
-    for (auto rule : bpe_state.rules) {
-      reversed_rules[rule.z] = {rule.x, rule.y};
-    }
-  }
-
+  uint64_t n_tokens = vocab_size();
   for (uint64_t i = 0; i < n_tokens; i++) {
     std::string token_z;
     Status status = id_to_subword(i, &token_z);
     assert(status.ok());
     std::cout << i << "\t" << token_z;
     if (verbose) {
-      if (reversed_rules.count(i)) {
+      const MergeNode &node = merge_node(i);
+      if (node.x != NO_TOKEN) {
         int used_symbols = 0;
-        auto comb = reversed_rules[i];
         std::string token_x;
         std::string token_y;
-        status = id_to_subword(comb.first, &token_x);
+        status = id_to_subword(node.x, &token_x);
         assert(status.ok());
-        status = id_to_subword(comb.second, &token_y);
+        status = id_to_subword(node.y, &token_y);
         assert(status.ok());
 
         used_symbols += decode_utf8(token_z).size() + 1;
@@ -1932,99 +3333,447 @@ void BaseEncoder::vocab_cli(bool verbose) const {
         for (int t = 0; t < std::max(2, 50 - used_symbols); t++) {
           std::cout << " ";
         }
-        std::cout << comb.first << "+" << comb.second;
+        std::cout << node.x << "+" << node.y;
       }
     }
     std::cout << std::endl;
   }
 }
 
+CacheStats BaseEncoder::cache_stats() const {
+  if (!cache) {
+    return CacheStats();
+  }
+  return cache->stats();
+}
+
+// Replaces the previous progress message of encode_cli in stderr.
+void print_progress(uint64_t bytes_processed, int *chars_remove) {
+  for (int i = 0; i < *chars_remove; i++) {
+    std::cerr << '\b';
+  }
+  std::string message = "bytes processed: ";
+  *chars_remove = message.size() + std::to_string(bytes_processed).length();
+  std::cerr << message << bytes_processed;
+}
+
+// Input files are encoded by blocks of about FILE_BLOCK_BYTES, each thread
+// gets BLOCKS_PER_THREAD blocks at a time.
+const uint64_t FILE_BLOCK_BYTES = 1 << 20;
+const uint64_t BLOCKS_PER_THREAD = 4;
+
+// Splits text into consecutive blocks of about block_bytes, every block but
+// the last one ends with a newline. Returns the block borders.
+std::vector<uint64_t> split_by_lines(const char *text, uint64_t size, uint64_t block_bytes) {
+  std::vector<uint64_t> borders = {0};
+  uint64_t pos = 0;
+  while (pos < size) {
+    uint64_t next = std::min(size, pos + block_bytes);
+    if (next < size) {
+      auto newline = static_cast<const char *>(memchr(text + next - 1, '\n', size - next + 1));
+      next = newline ? newline - text + 1 : size;
+    }
+    borders.push_back(next);
+    pos = next;
+  }
+  return borders;
+}
+
+Status BaseEncoder::encode_file_cli(OutputType output_type, const EncodingConfig &encoding_config,
+                                    const std::string &input_path,
+                                    const std::string &output_path) const {
+  Status status = check_encoding_config(encoding_config);
+  if (!status.ok()) {
+    return status;
+  }
+  MappedFile input;
+  status = input.open(input_path);
+  if (!status.ok()) {
+    return status;
+  }
+  // Opening the output truncates it, which would destroy the mapped input.
+  if (input.same_file(output_path) ||
+      (output_type == BINARY && input.same_file(output_path + ".idx"))) {
+    return Status(1, "The output file is the same as the input file: " + input_path);
+  }
+  DatasetWriter dataset;
+  PositionalFile output_file;
+  if (output_type == BINARY) {
+    status = open_dataset(output_path, &dataset);
+  } else if (!output_path.empty()) {
+    status = output_file.open(output_path);
+  }
+  if (!status.ok()) {
+    return status;
+  }
+  BufferedWriter stdout_writer;
+  std::cerr << "n_threads: " << n_threads << std::endl;
+
+  // The blocks are processed in rounds: the lines of every block of the round
+  // are counted to know the index of the first sentence in each block, then
+  // the blocks are encoded in parallel and written in order. Text output to a
+  // file is written by the threads themselves at known offsets.
+  const char *text = input.data();
+  std::vector<uint64_t> borders = split_by_lines(text, input.size(), FILE_BLOCK_BYTES);
+  uint64_t n_blocks = borders.size() - 1;
+  uint64_t round_blocks = n_threads * BLOCKS_PER_THREAD;
+  std::vector<uint64_t> first_line(round_blocks + 1);
+  std::vector<uint64_t> output_offsets(round_blocks);
+  std::vector<std::string> outputs(round_blocks);
+  std::vector<std::vector<std::vector<int>>> rows(round_blocks);
+  std::vector<Status> statuses(round_blocks);
+  uint64_t n_lines = 0;
+  uint64_t output_size = 0;
+  int chars_remove = 0;
+
+  for (uint64_t round_begin = 0; round_begin < n_blocks; round_begin += round_blocks) {
+    uint64_t n = std::min(round_blocks, n_blocks - round_begin);
+    run_parallel(n, [&](uint64_t k) {
+      const char *begin = text + borders[round_begin + k];
+      const char *end = text + borders[round_begin + k + 1];
+      // The last line of the file may have no newline
+      first_line[k + 1] = std::count(begin, end, '\n') + (end[-1] != '\n');
+    });
+    first_line[0] = n_lines;
+    for (uint64_t k = 0; k < n; k++) {
+      first_line[k + 1] += first_line[k];
+    }
+    n_lines = first_line[n];
+
+    run_parallel(n, [&](uint64_t k) {
+      const char *begin = text + borders[round_begin + k];
+      const char *end = text + borders[round_begin + k + 1];
+      std::string &output = outputs[k];
+      output.clear();
+      rows[k].clear();
+      std::vector<int> ids;
+      std::vector<std::string> subwords;
+      uint64_t sentence_id = first_line[k];
+      while (begin != end) {
+        auto newline = static_cast<const char *>(memchr(begin, '\n', end - begin));
+        const char *line_end = newline ? newline : end;
+        if (output_type == SUBWORD) {
+          subwords.clear();
+          encode_sentence(begin, line_end, encoding_config, sentence_id, &subwords);
+          format_sentence(subwords, &output);
+        } else if (output_type == ID) {
+          ids.clear();
+          encode_sentence(begin, line_end, encoding_config, sentence_id, &ids);
+          format_sentence(ids, &output);
+        } else {
+          rows[k].emplace_back();
+          encode_sentence(begin, line_end, encoding_config, sentence_id, &rows[k].back());
+        }
+        sentence_id++;
+        begin = newline ? newline + 1 : end;
+      }
+    });
+
+    if (output_type == BINARY) {
+      for (uint64_t k = 0; k < n; k++) {
+        status = dataset.write(rows[k]);
+        if (!status.ok()) {
+          return status;
+        }
+      }
+    } else if (!output_path.empty()) {
+      for (uint64_t k = 0; k < n; k++) {
+        output_offsets[k] = output_size;
+        output_size += outputs[k].size();
+      }
+      run_parallel(n, [&](uint64_t k) {
+        statuses[k] = output_file.write_at(outputs[k].data(), outputs[k].size(), output_offsets[k]);
+      });
+      for (uint64_t k = 0; k < n; k++) {
+        if (!statuses[k].ok()) {
+          return statuses[k];
+        }
+      }
+    } else {
+      for (uint64_t k = 0; k < n; k++) {
+        stdout_writer.write(outputs[k]);
+      }
+    }
+    print_progress(borders[round_begin + n], &chars_remove);
+  }
+  status = stdout_writer.flush();
+  std::cerr << std::endl;
+  if (!status.ok()) {
+    return status;
+  }
+  if (output_type == BINARY) {
+    return dataset.close();
+  }
+  return output_file.close();
+}
+
 Status BaseEncoder::encode_cli(const std::string &output_type_str, bool stream,
-                               bool bos, bool eos, bool reverse, double dropout_prob) const {
+                               bool bos, bool eos, bool reverse, double dropout_prob,
+                               int64_t dropout_seed, const std::string &input_path,
+                               const std::string &output_path) const {
   std::ios_base::sync_with_stdio(false);
+  // With an explicit seed, every batch (every sentence in the stream mode) gets
+  // its own seed derived from it.
+  uint64_t n_batches = 0;
+  auto batch_seed = [&]() -> int64_t {
+    if (dropout_seed < 0) {
+      return -1;
+    }
+    return static_cast<int64_t>(mix_seed(dropout_seed + n_batches++) >> 1u);
+  };
   OutputType output_type;
   if (output_type_str == "id") {
     output_type = ID;
-  } else {
-    assert(output_type_str == "subword");
+  } else if (output_type_str == "subword") {
     output_type = SUBWORD;
+  } else {
+    assert(output_type_str == "binary");
+    output_type = BINARY;
+    if (output_path.empty()) {
+      return Status(1, "Binary output requires the path of the dataset");
+    }
+  }
+  if (stream && (!input_path.empty() || !output_path.empty())) {
+    return Status(1, "The stream mode reads stdin and writes stdout only");
   }
   if (stream) {
+    BufferedWriter writer;
+    std::string line;
     if (output_type == SUBWORD) {
       std::string sentence;
       while (getline(std::cin, sentence)) {
         std::vector<std::vector<std::string>> subwords;
-        Status status = encode_as_subwords({sentence}, &subwords, bos, eos, reverse, dropout_prob);
+        SentenceView view = {sentence.data(), sentence.size()};
+        Status status = encode_as_subwords(SentenceBatch(&view, 1), &subwords, bos, eos, reverse,
+                                           dropout_prob, batch_seed());
+        if (!status.ok()) {
+          return status;
+        }
+        line.clear();
+        format_sentences(subwords, 0, subwords.size(), &line);
+        writer.write(line);
+        status = writer.flush();
         if (!status.ok()) {
           return status;
         }
-        write_to_stdout(subwords, true);
       }
     } else {
       assert(output_type == ID);
       std::string sentence;
       while (getline(std::cin, sentence)) {
         std::vector<std::vector<int>> ids;
-        Status status = encode_as_ids({sentence}, &ids, bos, eos, reverse, dropout_prob);
+        SentenceView view = {sentence.data(), sentence.size()};
+        Status status = encode_as_ids(SentenceBatch(&view, 1), &ids, bos, eos, reverse,
+                                      dropout_prob, batch_seed());
+        if (!status.ok()) {
+          return status;
+        }
+        line.clear();
+        format_sentences(ids, 0, ids.size(), &line);
+        writer.write(line);
+        status = writer.flush();
         if (!status.ok()) {
           return status;
         }
-        write_to_stdout(ids, true);
       }
     }
+  } else if (!input_path.empty()) {
+    return encode_file_cli(
+        output_type, make_encoding_config(bos, eos, reverse, dropout_prob, dropout_seed),
+        input_path, output_path);
   } else {
+    // Reading, encoding and writing run as a pipeline: a reader thread fills
+    // batches from stdin, the calling thread encodes them with the thread
+    // pool, and a writer thread prints them in the order they were read.
+    // The queues hold at most two batches each, so every stage works on
+    // one batch while the next one is waiting for it.
     const uint64_t batch_limit = 10 * 1024 * 1024;
-    uint64_t total_progress = 0;
-    uint64_t processed;
+    const uint64_t queue_capacity = 2;
     std::cerr << "n_threads: " << n_threads << std::endl;
-    int chars_remove = 0;
-    do {
-      processed = 0;
-      auto sentences = read_lines_from_stdin(batch_limit, &processed);
-      if (output_type == SUBWORD) {
-        std::vector<std::vector<std::string>> subwords;
-        Status status = encode_as_subwords(sentences, &subwords, bos, eos, reverse, dropout_prob);
-        if (!status.ok()) {
-          return status;
+
+    Status status = check_encoding_config(
+        make_encoding_config(bos, eos, reverse, dropout_prob, dropout_seed));
+    if (!status.ok()) {
+      return status;
+    }
+    DatasetWriter dataset;
+    FILE *output_file = stdout;
+    if (output_type == BINARY) {
+      status = open_dataset(output_path, &dataset);
+      if (!status.ok()) {
+        return status;
+      }
+    } else if (!output_path.empty()) {
+      output_file = fopen(output_path.c_str(), "wb");
+      if (!output_file) {
+        return Status(1, "Can't open file: " + output_path);
+      }
+    }
+
+    struct Batch {
+      std::vector<std::string> sentences;
+      // formatted encoded sentences, or ids for the binary output
+      std::vector<std::string> output;
+      std::vector<std::vector<int>> ids;
+      uint64_t processed{0};
+    };
+    BoundedQueue<Batch> read_queue(queue_capacity);
+    BoundedQueue<Batch> write_queue(queue_capacity);
+
+    std::thread reader([&]() {
+      uint64_t processed;
+      do {
+        Batch batch;
+        processed = 0;
+        batch.sentences = read_lines_from_stdin(batch_limit, &processed);
+        batch.processed = processed;
+        if (!read_queue.push(std::move(batch))) {
+          return;
         }
-        write_to_stdout(subwords, false);
-      } else {
-        assert(output_type == ID);
-        std::vector<std::vector<int>> ids;
-        Status status = encode_as_ids(sentences, &ids, bos, eos, reverse, dropout_prob);
-        if (!status.ok()) {
-          return status;
+      } while (processed >= batch_limit);
+      read_queue.close();
+    });
+
+    Status write_status;
+    std::thread writer([&]() {
+      BufferedWriter output(output_file);
+      uint64_t total_progress = 0;
+      int chars_remove = 0;
+      Batch batch;
+      while (write_queue.pop(&batch)) {
+        if (output_type == BINARY) {
+          write_status = dataset.write(batch.ids);
+        } else {
+          for (const auto &chunk : batch.output) {
+            output.write(chunk);
+          }
+          // Flushing every batch finds a failed write before the rest of
+          // stdin is encoded
+          write_status = output.flush();
+        }
+        if (!write_status.ok()) {
+          // Stops the reader and the encoding loop
+          read_queue.close();
+          write_queue.close();
+          break;
         }
-        write_to_stdout(ids, false);
+        total_progress += batch.processed;
+        print_progress(total_progress, &chars_remove);
       }
-      total_progress += processed;
+      if (write_status.ok()) {
+        write_status = output.flush();
+      }
+      std::cerr << std::endl;
+    });
 
-      for (int i = 0; i < chars_remove; i++) {
-        std::cerr << '\b';
+    Batch batch;
+    std::vector<std::vector<std::string>> subwords;
+    std::vector<std::vector<int>> ids;
+    while (status.ok() && read_queue.pop(&batch)) {
+      if (output_type == SUBWORD) {
+        status = encode_as_subwords(batch.sentences, &subwords, bos, eos, reverse,
+                                    dropout_prob, batch_seed());
+        if (status.ok()) {
+          batch.output = format_parallel(batch.sentences, subwords);
+        }
+      } else if (output_type == ID) {
+        status = encode_as_ids(batch.sentences, &ids, bos, eos, reverse, dropout_prob,
+                               batch_seed());
+        if (status.ok()) {
+          batch.output = format_parallel(batch.sentences, ids);
+        }
+      } else {
+        assert(output_type == BINARY);
+        status = encode_as_ids(batch.sentences, &batch.ids, bos, eos, reverse, dropout_prob,
+                               batch_seed());
+      }
+      batch.sentences = std::vector<std::string>();
+      if (status.ok() && !write_queue.push(std::move(batch))) {
+        // The writer has failed
+        break;
       }
-      chars_remove = 0;
-      std::string message = "bytes processed: ";
-      chars_remove += message.size();
-      chars_remove += std::to_string(total_progress).length();
-      std::cerr << message << total_progress;
-    } while (processed >= batch_limit);
-    std::cerr << std::endl;
+    }
+    read_queue.close();
+    write_queue.close();
+    reader.join();
+    writer.join();
+    if (output_file != stdout && fclose(output_file) != 0 && status.ok()) {
+      status = Status(1, "Failed to write file: " + output_path);
+    }
+    if (!status.ok()) {
+      return status;
+    }
+    if (!write_status.ok()) {
+      return write_status;
+    }
+    return dataset.close();
   }
   return Status();
 }
 
 Status BaseEncoder::decode_cli(const std::unordered_set<int> *ignore_ids) const {
-  std::ios_base::sync_with_stdio(false);
-  std::string sentence;
-  while (getline(std::cin, sentence)) {
-    std::vector<std::string> output;
-    Status status = decode({sentence}, &output, ignore_ids);
-    if (!status.ok()) {
-      return status;
+  // stdin is read by blocks of whole lines. The lines of a block are split
+  // into chunks that are parsed and decoded by the thread pool, then the
+  // decoded chunks are written in order.
+  const uint64_t block_bytes = 8 * 1024 * 1024;
+  std::vector<uint64_t> ignored = ignore_bitmap(ignore_ids);
+  BufferedWriter writer;
+  std::string buffer;
+  std::vector<std::string> outputs;
+  std::vector<Status> statuses;
+  bool eof = false;
+  while (!eof) {
+    uint64_t old_size = buffer.size();
+    buffer.resize(old_size + block_bytes);
+    uint64_t n_read = fread(&buffer[old_size], 1, block_bytes, stdin);
+    buffer.resize(old_size + n_read);
+    eof = n_read < block_bytes;
+    uint64_t size = buffer.size();
+    if (!eof) {
+      // The incomplete last line is left for the next block
+      uint64_t last_newline = buffer.rfind('\n');
+      if (last_newline == std::string::npos) {
+        continue;
+      }
+      size = last_newline + 1;
+    }
+
+    const char *text = buffer.data();
+    uint64_t chunk_bytes = std::max(MIN_CHUNK_BYTES, size / (n_threads * CHUNKS_PER_THREAD));
+    std::vector<uint64_t> borders = split_by_lines(text, size, chunk_bytes);
+    uint64_t n_chunks = borders.size() - 1;
+    outputs.resize(std::max<uint64_t>(outputs.size(), n_chunks));
+    statuses.assign(n_chunks, Status());
+    run_parallel(n_chunks, [&](uint64_t k) {
+      const char *begin = text + borders[k];
+      const char *end = text + borders[k + 1];
+      std::string &output = outputs[k];
+      output.clear();
+      std::vector<int> ids;
+      while (begin != end) {
+        auto newline = static_cast<const char *>(memchr(begin, '\n', end - begin));
+        const char *line_end = newline ? newline : end;
+        ids.clear();
+        parse_ints(begin, line_end, &ids);
+        // The lines before the first invalid one are still written
+        statuses[k] = decode_ids(ids.data(), ids.data() + ids.size(), ignored, ignore_ids,
+                                 &output);
+        if (!statuses[k].ok()) {
+          return;
+        }
+        output.push_back('\n');
+        begin = newline ? newline + 1 : end;
+      }
+    });
+    for (uint64_t k = 0; k < n_chunks; k++) {
+      writer.write(outputs[k]);
+      if (!statuses[k].ok()) {
+        return statuses[k];
+      }
     }
-    std::cout << output[0] << "\n";
+    buffer.erase(0, size);
   }
-  return Status();
+  return writer.flush();
 }
 
 }  // namespace vkcom
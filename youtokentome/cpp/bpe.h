@@ -1,6 +1,12 @@
 #pragma once
 
+#include <algorithm>
+#include <deque>
+#include <initializer_list>
+#include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_set>
 #include "third_party/flat_hash_map.h"
@@ -14,38 +20,360 @@ const std::string PAD_TOKEN = "<PAD>";
 const std::string BOS_TOKEN = "<BOS>";
 const std::string EOS_TOKEN = "<EOS>";
 
-enum OutputType { ID, SUBWORD };
+enum OutputType { ID, SUBWORD, BINARY };
+
+const uint32_t NO_TOKEN = UINT32_MAX;
+
+// A subword as a range of bytes owned by the encoder or by SubwordViews.
+struct SubwordView {
+  const char *data;
+  uint64_t size;
+
+  std::string str() const;
+};
+
+// Code points of a token, see BaseEncoder::token_chars.
+struct CodePointsView {
+  const uint32_t *data;
+  uint64_t size;
+
+  const uint32_t *begin() const { return data; }
+
+  const uint32_t *end() const { return data + size; }
+};
+
+// Children of a token in the tree of merges: the token is the result of the
+// rule x + y -> token. Both are NO_TOKEN for characters and special tokens.
+struct MergeNode {
+  uint32_t x;
+  uint32_t y;
+};
+
+// Output of BaseEncoder::encode_as_subword_views.
+struct SubwordViews {
+  // Subwords of each sentence.
+  std::vector<std::vector<SubwordView>> pieces;
+  // Strings of runs of characters unknown to the model. Elements of a deque
+  // are never moved, so views into them stay valid while new ones are added.
+  std::deque<std::string> unknown;
+};
+
+// A sentence as a range of UTF-8 bytes owned by the caller.
+struct SentenceView {
+  const char *data;
+  uint64_t size;
+};
+
+// Sentences to encode, read in place: their bytes are not copied and must stay
+// valid until the encoding call returns. A batch refers to a vector of strings,
+// to an array of views, or to one buffer with offsets (CSR, the layout of a
+// string column of Apache Arrow), where the i-th sentence is
+// data[offsets[i]], ..., data[offsets[i + 1] - 1].
+class SentenceBatch {
+ public:
+  SentenceBatch() = default;
+
+  // Implicit, so a vector of strings is passed to the encoding methods as is.
+  SentenceBatch(const std::vector<std::string> &sentences)
+      : strings(sentences.data()), n_sentences(sentences.size()) {}
+
+  // Implicit as well, for calls like encode_as_ids({sentence}, &ids). The batch
+  // keeps its own copy of these strings.
+  SentenceBatch(std::initializer_list<std::string> sentences)
+      : owned(std::make_shared<const std::vector<std::string>>(sentences)),
+        strings(owned->data()), n_sentences(owned->size()) {}
+
+  SentenceBatch(const SentenceView *_views, uint64_t _n_sentences)
+      : views(_views), n_sentences(_n_sentences) {}
+
+  // offsets has n_sentences + 1 elements and must be non-decreasing.
+  SentenceBatch(const char *_data, const uint64_t *_offsets, uint64_t _n_sentences)
+      : data(_data), offsets(_offsets), n_sentences(_n_sentences) {}
+
+  uint64_t size() const { return n_sentences; }
+
+  SentenceView operator[](uint64_t i) const {
+    if (strings) {
+      return {strings[i].data(), strings[i].size()};
+    }
+    if (views) {
+      return views[i];
+    }
+    return {data + offsets[i], offsets[i + 1] - offsets[i]};
+  }
+
+  uint64_t total_bytes() const;
+
+ private:
+  std::shared_ptr<const std::vector<std::string>> owned;
+  const std::string *strings = nullptr;
+  const SentenceView *views = nullptr;
+  const char *data = nullptr;
+  const uint64_t *offsets = nullptr;
+  uint64_t n_sentences = 0;
+};
+
+// Algorithm applying merge rules to words. Both give the same result.
+enum EncodingEngine {
+  // Pairs of adjacent tokens are kept in a priority queue, O(n log n) for a word of n characters.
+  PRIORITY_QUEUE,
+  // Longest tokens are taken from left to right, with backtracking, close to O(n).
+  // BPE-dropout and models where some token can't be obtained from its own string
+  // are handled by PRIORITY_QUEUE.
+  BACKTRACKING
+};
+
+struct EncoderConfig {
+  // Memory limit of the word cache in bytes. 0 disables the cache.
+  uint64_t cache_size = 0;
+  // Ids of characters with code points below this bound are stored in an array,
+  // other characters are looked up in a hash map. Values below 128 are rounded up to 128.
+  uint32_t dense_char_limit = 1u << 16u;
+  EncodingEngine engine = PRIORITY_QUEUE;
+
+  EncoderConfig() = default;
+
+  explicit EncoderConfig(uint64_t cache_size);
+};
+
+struct CacheStats {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t entries = 0;
+  uint64_t memory = 0;
+};
+
+// Maps a pair of tokens (x, y) to the id of the rule x + y -> z.
+// Pairs of tokens with small ids (characters) are looked up in a dense matrix,
+// other pairs in an open addressing hash table with linear probing, so that
+// a lookup usually touches a single cache line.
+class RuleTable {
+ public:
+  void build(const std::vector<BPE_Rule> &rules);
+
+  // Sets MODEL_RULE_DENSE and MODEL_RULE_SLOTS, see BPEState::dump_binary.
+  void dump(ModelSections *sections) const;
+
+  // Refers to the table in a binary model with n_rules rules.
+  Status load(const ModelSections &sections, uint64_t n_rules);
+
+  // Returns the id of the rule, or -1 if the tokens can't be merged.
+  int find(uint32_t x, uint32_t y) const {
+    if (x < dense_size && y < dense_size) {
+      return dense[x * dense_size + y];
+    }
+    uint64_t key = (static_cast<uint64_t>(x) << 32u) + y;
+    for (uint64_t pos = slot_index(key);; pos = (pos + 1) & mask) {
+      const Slot &slot = slots[pos];
+      if (slot.key == key) {
+        return slot.rule_id;
+      }
+      if (slot.rule_id == -1) {
+        return -1;
+      }
+    }
+  }
+
+  uint64_t memory() const;
+
+ private:
+  struct Slot {
+    uint64_t key;
+    int rule_id;
+    // Zero, so that binary models don't depend on uninitialized bytes.
+    int padding;
+  };
+
+  MappedArray<int> dense;
+  uint32_t dense_size{0};
+  MappedArray<Slot> slots;
+  uint64_t mask{0};
+  int shift{64};
+
+  uint64_t slot_index(uint64_t key) const {
+    return (key * 0x9E3779B97F4A7C15ull) >> shift;
+  }
+};
+
+// Maps code points to ids of characters.
+class CharTable {
+ public:
+  static const uint32_t NOT_FOUND = UINT32_MAX;
+
+  explicit CharTable(uint32_t dense_limit = 1u << 16u);
+
+  void build(const flat_hash_map<uint32_t, uint32_t> &char2id);
+
+  // Sets MODEL_CHAR_DENSE and MODEL_CHAR_SPARSE, see BPEState::dump_binary.
+  void dump(ModelSections *sections) const;
+
+  // Refers to the table in a binary model with n_tokens tokens, dense_limit
+  // doesn't apply to it.
+  Status load(const ModelSections &sections, uint64_t n_tokens);
+
+  // Returns the id of the character, or NOT_FOUND if the model doesn't know it.
+  uint32_t find(uint32_t ch) const {
+    if (ch < dense.size()) {
+      return dense[ch];
+    }
+    auto it = std::lower_bound(sparse.begin(), sparse.end(), ch,
+                               [](const SparseChar &x, uint32_t ch) { return x.code_point < ch; });
+    return it != sparse.end() && it->code_point == ch ? it->id : NOT_FOUND;
+  }
+
+  // Same as find, for ch < 128.
+  uint32_t find_ascii(uint8_t ch) const {
+    return dense[ch];
+  }
+
+ private:
+  struct SparseChar {
+    uint32_t code_point;
+    uint32_t id;
+  };
+
+  uint32_t dense_limit;
+  MappedArray<uint32_t> dense;
+  // Characters with larger code points, sorted by code point.
+  MappedArray<SparseChar> sparse;
+};
+
+class BacktrackingEncoder;
+
+class WordCache;
+
+class DropoutRandom;
+
+struct EncodingContext;
 
 Status train_bpe(const std::string &input_path, const std::string &model_path,
                  int vocab_size, BpeConfig config);
 
+// Const methods of an encoder may be called from several threads at once. A call that
+// finds the thread pool busy with another call runs on the calling thread alone, the word
+// cache is locked per shard, and the state of BPE-dropout is derived from the seed and the
+// position of a sentence, so no random generator is shared between calls.
 class BaseEncoder {
  public:
   BPEState bpe_state;
-  flat_hash_map<uint32_t, uint32_t> id2char;
-  flat_hash_map<uint32_t, std::vector<uint32_t>> recipe;
-  flat_hash_map<std::string, uint32_t> reversed_recipe;
-  flat_hash_map<uint64_t, int> rule2id;
+  RuleTable rule_table;
+  CharTable char_table;
   int n_threads;
 
-  explicit BaseEncoder(BPEState bpe_state, int _n_threads);
+  explicit BaseEncoder(BPEState bpe_state, int _n_threads,
+                       const EncoderConfig &config = EncoderConfig());
+
+  // The model is read from a text file written by BPEState::dump or from a
+  // binary model written by dump_binary. A binary model is mapped into memory
+  // and its tables are used in place, so the processes that load the same
+  // binary model share a single copy of it.
+  explicit BaseEncoder(const std::string &model_path, int n_threads, Status *ret_status,
+                       const EncoderConfig &config = EncoderConfig());
 
-  explicit BaseEncoder(const std::string &model_path, int n_threads, Status *ret_status);
+  BaseEncoder(BaseEncoder &&other) noexcept;
+
+  ~BaseEncoder();
 
   void fill_from_state();
 
+  // Writes the model together with the lookup tables of the encoder in the
+  // binary format, which is loaded without building the tables again.
+  Status dump_binary(const std::string &path) const;
+
+  // Sentences of all encoding methods are read in place, see SentenceBatch.
+  // BPE-dropout with a given dropout_seed gives the same result for any number of
+  // threads. If dropout_seed is negative, a new seed is chosen for every call.
   Status encode_as_ids(
-      const std::vector<std::string> &sentences, std::vector<std::vector<int>> *ids, bool bos = false,
-      bool eos = false, bool reverse = false, double dropout_prob=0) const;
+      const SentenceBatch &sentences, std::vector<std::vector<int>> *ids, bool bos = false,
+      bool eos = false, bool reverse = false, double dropout_prob = 0,
+      int64_t dropout_seed = -1) const;
 
   Status encode_as_subwords(
-      const std::vector<std::string> &sentences,
+      const SentenceBatch &sentences,
       std::vector<std::vector<std::string>> *subwords,
       bool bos = false,
-      bool eos = false, bool reverse = false, double dropout_prob=0) const;
+      bool eos = false, bool reverse = false, double dropout_prob = 0,
+      int64_t dropout_seed = -1) const;
+
+  // Same as encode_as_subwords, but subwords are views into the strings of
+  // tokens stored in the encoder, without a copy for each subword.
+  Status encode_as_subword_views(
+      const SentenceBatch &sentences, SubwordViews *subwords,
+      bool bos = false, bool eos = false, bool reverse = false, double dropout_prob = 0,
+      int64_t dropout_seed = -1) const;
+
+  // Writes ids of all sentences into one buffer. Ids of the i-th sentence are
+  // ids[offsets[i]], ..., ids[offsets[i + 1] - 1]. offsets has sentences.size() + 1 elements.
+  Status encode_as_ids_flat(
+      const SentenceBatch &sentences, std::vector<int> *ids,
+      std::vector<uint64_t> *offsets, bool bos = false, bool eos = false,
+      bool reverse = false, double dropout_prob = 0, int64_t dropout_seed = -1) const;
+
+  // Fails if some id of the vocabulary does not fit into uint16_t.
+  Status encode_as_ids_flat(
+      const SentenceBatch &sentences, std::vector<uint16_t> *ids,
+      std::vector<uint64_t> *offsets, bool bos = false, bool eos = false,
+      bool reverse = false, double dropout_prob = 0, int64_t dropout_seed = -1) const;
+
+  // Encodes every sentence n_samples times with BPE-dropout. Words are decoded and split
+  // into characters once for all samples. Ids of the k-th sample of the i-th sentence are
+  // ids[offsets[i * n_samples + k]], ..., ids[offsets[i * n_samples + k + 1] - 1]. The sample
+  // is the same as the result of encode_as_ids with the same dropout_seed for a batch where
+  // the sentence is at position i * n_samples + k.
+  Status encode_as_ids_samples(
+      const SentenceBatch &sentences, uint64_t n_samples, std::vector<int> *ids,
+      std::vector<uint64_t> *offsets, bool bos = false, bool eos = false,
+      bool reverse = false, double dropout_prob = 0, int64_t dropout_seed = -1) const;
+
+  // Writes ids into a matrix with sentences.size() rows and *max_len columns, where
+  // *max_len is the length of the longest sentence. Rows are padded with pad_id,
+  // lengths receives the number of ids in each row.
+  Status encode_as_ids_padded(
+      const SentenceBatch &sentences, std::vector<int> *matrix,
+      std::vector<uint64_t> *lengths, uint64_t *max_len, bool bos = false,
+      bool eos = false, bool reverse = false, double dropout_prob = 0,
+      int64_t dropout_seed = -1) const;
+
+  Status encode_as_ids_padded(
+      const SentenceBatch &sentences, std::vector<uint16_t> *matrix,
+      std::vector<uint64_t> *lengths, uint64_t *max_len, bool bos = false,
+      bool eos = false, bool reverse = false, double dropout_prob = 0,
+      int64_t dropout_seed = -1) const;
+
+  // Writes the i-th row of a matrix with sentences.size() rows and max_len columns:
+  // BOS, ids of the i-th sentence and EOS, padded with pad_id. Ids of the sentence that
+  // don't fit are dropped from the end, or from the start if truncate_left is set; BOS and
+  // EOS are kept. lengths[i] receives the number of ids before padding. Words after the kept
+  // ids are not encoded (words before them too, if truncate_left is set and dropout_prob is 0).
+  Status encode_as_ids_fixed(
+      const SentenceBatch &sentences, uint64_t max_len, bool truncate_left,
+      int *matrix, uint64_t *lengths, bool bos = false, bool eos = false, bool reverse = false,
+      double dropout_prob = 0, int64_t dropout_seed = -1) const;
+
+  Status encode_as_ids_fixed(
+      const SentenceBatch &sentences, uint64_t max_len, bool truncate_left,
+      uint16_t *matrix, uint64_t *lengths, bool bos = false, bool eos = false, bool reverse = false,
+      double dropout_prob = 0, int64_t dropout_seed = -1) const;
 
   Status id_to_subword(int id, std::string *subword, bool replace_space = false) const;
 
+  // UTF-8 string of the token, id must be in the range [0, vocab_size - 1].
+  SubwordView piece(uint32_t id) const {
+    return {piece_pool.data() + piece_offsets[id], piece_offsets[id + 1] - piece_offsets[id]};
+  }
+
+  // Code points of the token, empty for special tokens. id must be in the
+  // range [0, vocab_size - 1].
+  CodePointsView token_chars(uint32_t id) const {
+    return {token_char_pool.data() + token_char_offsets[id],
+            token_char_offsets[id + 1] - token_char_offsets[id]};
+  }
+
+  // id must be in the range [0, vocab_size - 1].
+  const MergeNode &merge_node(uint32_t id) const {
+    return merge_tree[id];
+  }
+
   int subword_to_id(const std::string &token) const;
 
   Status decode(const std::vector<std::vector<int>> &ids,
@@ -60,25 +388,167 @@ class BaseEncoder {
 
   int vocab_size() const;
 
+  uint64_t model_hash() const;
+
+  // Opens a binary dataset for the ids of this model. Ids are stored as
+  // uint16 if the whole vocabulary fits into it and as uint32 otherwise.
+  Status open_dataset(const std::string &path, DatasetWriter *writer) const;
+
   std::vector<std::string> vocabulary() const;
 
+  // output_type is "id", "subword" or "binary". Binary output is written to
+  // the dataset at output_path (see DatasetWriter), the other ones to
+  // output_path or to stdout if it is empty. The input is read from
+  // input_path or from stdin if it is empty.
   Status encode_cli(const std::string &output_type, bool stream, bool bos = false,
-                    bool eos = false, bool reverse = false, double dropout_prob = 0) const;
+                    bool eos = false, bool reverse = false, double dropout_prob = 0,
+                    int64_t dropout_seed = -1, const std::string &input_path = "",
+                    const std::string &output_path = "") const;
 
   Status decode_cli(const std::unordered_set<int> *ignore_ids) const;
 
   void vocab_cli(bool verbose) const;
 
+  CacheStats cache_stats() const;
+
+  // Engine used for encoding without BPE-dropout.
+  EncodingEngine encoding_engine() const;
+
  private:
-  DecodeResult encode_sentence(const std::string &sentence_utf8,
-                               const EncodingConfig &encoding_config,
-                               OutputType output_type) const;
-
-  Status encode_parallel(
-      const std::vector<std::string> &sentences,
-      const EncodingConfig &encoding_config, OutputType output_type,
-      std::vector<DecodeResult> *decoder_results
-  ) const;
+  // Strings of all tokens one after another, the string of token i is
+  // piece_pool[piece_offsets[i], piece_offsets[i + 1]).
+  MappedArray<char> piece_pool;
+  MappedArray<uint64_t> piece_offsets;
+  // Strings of tokens as they appear in decoded text, where the leading
+  // SPACE_TOKEN is replaced with a space. Same layout as piece_pool.
+  MappedArray<char> decode_pool;
+  MappedArray<uint64_t> decode_offsets;
+  // Ids of all tokens except the special ones, sorted by their strings.
+  MappedArray<uint32_t> piece_index;
+  // Code points of all tokens one after another, the code points of token i
+  // are token_char_pool[token_char_offsets[i], token_char_offsets[i + 1]).
+  MappedArray<uint32_t> token_char_pool;
+  MappedArray<uint64_t> token_char_offsets;
+  // Node of every token in the tree of merges.
+  MappedArray<MergeNode> merge_tree;
+  // bpe_state.rules or MODEL_RULES of the binary model.
+  MappedArray<BPE_Rule> rules;
+  // Binary model the tables refer to.
+  std::unique_ptr<MappedFile> model_file;
+  std::unique_ptr<WordCache> cache;
+  std::unique_ptr<BacktrackingEncoder> backtracking;
+  std::unique_ptr<ThreadPool> thread_pool;
+
+  // Fills token_char_pool, token_char_offsets and merge_tree from bpe_state.
+  void fill_token_chars();
+
+  Status load_binary(const std::string &model_path);
+
+  // Checks that token_char_pool and merge_tree of a binary model agree with
+  // the characters and rules of bpe_state.
+  bool check_token_chars() const;
+
+  Status check_encoding_config(const EncodingConfig &encoding_config) const;
+
+  template<typename Char>
+  bool append_chars(const Char *begin, const Char *end, EncodingContext *ctx) const;
+
+  // Fills ctx->list with SPACE_TOKEN and the characters of the word.
+  // Returns false if the word has no valid characters.
+  bool prepare_word(const char *begin, const char *end, bool *has_unknown,
+                    bool *invalid_input, EncodingContext *ctx) const;
+
+  // Applies merges to ctx->list and appends the resulting tokens to *tokens.
+  void merge_word(double dropout_prob, DropoutRandom *random, EncodingContext *ctx,
+                  std::vector<uint32_t> *tokens) const;
+
+  // Stops after the word with which the number of tokens reaches max_tokens. If from_end is
+  // set, words are encoded from the last one, so only the last tokens are complete.
+  void encode_words(const char *begin, const char *end, const EncodingConfig &encoding_config,
+                    uint64_t sentence_id, EncodingContext *ctx,
+                    uint64_t max_tokens = std::numeric_limits<uint64_t>::max(),
+                    bool from_end = false) const;
+
+  // Tokens of the k-th sample are written to ctx->sample_tokens[k].
+  void encode_word_samples(const char *begin, const char *end,
+                           const EncodingConfig &encoding_config, uint64_t sentence_id,
+                           uint64_t n_samples, EncodingContext *ctx) const;
+
+  template<typename IdType>
+  void append_ids(const std::vector<uint32_t> &tokens, const EncodingConfig &encoding_config,
+                  std::vector<IdType> *ids) const;
+
+  template<typename IdType>
+  void encode_sentence(const char *begin, const char *end,
+                       const EncodingConfig &encoding_config, uint64_t sentence_id,
+                       std::vector<IdType> *ids) const;
+
+  // Writes max_len ids to row, see encode_as_ids_fixed.
+  template<typename IdType>
+  void encode_sentence_fixed(const char *begin, const char *end,
+                             const EncodingConfig &encoding_config, uint64_t sentence_id,
+                             uint64_t max_len, bool truncate_left, IdType *row,
+                             uint64_t *length) const;
+
+  // Appends ids of all samples to *ids, sample_ends[k] is set to the end of the k-th sample.
+  template<typename IdType>
+  void encode_sentence_samples(const char *begin, const char *end,
+                               const EncodingConfig &encoding_config, uint64_t sentence_id,
+                               uint64_t n_samples, std::vector<IdType> *ids,
+                               uint64_t *sample_ends) const;
+
+  void encode_sentence(const char *begin, const char *end,
+                       const EncodingConfig &encoding_config, uint64_t sentence_id,
+                       std::vector<std::string> *pieces) const;
+
+  void encode_sentence(const char *begin, const char *end,
+                       const EncodingConfig &encoding_config, uint64_t sentence_id,
+                       std::vector<SubwordView> *pieces,
+                       std::deque<std::string> *unknown, std::mutex *unknown_mt) const;
+
+  template<typename IdType>
+  Status encode_flat(const SentenceBatch &sentences,
+                     const EncodingConfig &encoding_config, uint64_t n_samples,
+                     std::vector<IdType> *ids, std::vector<uint64_t> *offsets) const;
+
+  template<typename IdType>
+  Status encode_fixed(const SentenceBatch &sentences,
+                      const EncodingConfig &encoding_config, uint64_t max_len,
+                      bool truncate_left, IdType *matrix, uint64_t *lengths) const;
+
+  template<typename IdType>
+  Status encode_padded(const SentenceBatch &sentences,
+                       const EncodingConfig &encoding_config, std::vector<IdType> *matrix,
+                       std::vector<uint64_t> *lengths, uint64_t *max_len) const;
+
+  // Bitmap of the ids from ignore_ids that are in [0, vocab_size), empty if
+  // there are no ids to ignore.
+  std::vector<uint64_t> ignore_bitmap(const std::unordered_set<int> *ignore_ids) const;
+
+  // Appends the decoded ids to *sentence. Ids set in the bitmap `ignored`
+  // (see ignore_bitmap) are skipped; if the bitmap is empty, ids found in
+  // ignore_ids are. Nothing is appended if an id is invalid.
+  Status decode_ids(const int *begin, const int *end, const std::vector<uint64_t> &ignored,
+                    const std::unordered_set<int> *ignore_ids, std::string *sentence) const;
+
+  // Runs task(i) for every i in [0, n_tasks) by the thread pool, or by the
+  // calling thread if there is no pool.
+  void run_parallel(uint64_t n_tasks, const std::function<void(uint64_t)> &task) const;
+
+  template<typename EncodeFunction>
+  void encode_parallel(const SentenceBatch &sentences,
+                       const EncodeFunction &encode) const;
+
+  // Formats the encoded sentences for the command line tools. Chunks of
+  // roughly equal size are formatted by the thread pool.
+  template<typename T>
+  std::vector<std::string> format_parallel(const SentenceBatch &sentences,
+                                           const std::vector<std::vector<T>> &tokens) const;
+
+  // encode_cli for the input from a file. The file is mapped into memory and
+  // its lines are encoded in place by the thread pool.
+  Status encode_file_cli(OutputType output_type, const EncodingConfig &encoding_config,
+                         const std::string &input_path, const std::string &output_path) const;
 };
 
 } // namespace vkcom
@@ -1,10 +1,15 @@
 #include "utf8.h"
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <string>
 #include <vector>
 #include "utils.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+
 namespace vkcom {
 
 using std::string;
@@ -108,19 +113,222 @@ string encode_utf8(const vector<uint32_t>& text) {
   return utf8_text;
 }
 
-vector<uint32_t> decode_utf8(const char* begin, const char* end) {
-  vector<uint32_t> decoded_text;
+// Decoders write at most one code point per byte of input to `out` and return
+// the number of written code points. Invalid sequences are counted in *n_invalid.
+typedef uint64_t (*DecodeFunction)(const char *begin, const char *end, uint32_t *out,
+                                   uint64_t *n_invalid);
+
+uint64_t decode_utf8_scalar(const char *begin, const char *end, uint32_t *out,
+                            uint64_t *n_invalid) {
+  uint32_t *out_begin = out;
   uint64_t utf8_len = 0;
-  bool invalid_input = false;
   for (; begin < end; begin += utf8_len) {
     uint32_t code_point = chars_to_utf8(begin, end - begin, &utf8_len);
     if (code_point != INVALID_UNICODE) {
-      decoded_text.push_back(code_point);
+      *out++ = code_point;
     } else {
-      invalid_input = true;
+      (*n_invalid)++;
+    }
+  }
+  return out - out_begin;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define YTTM_SIMD_UTF8
+
+// Widens 16 bytes to 16 code points.
+inline void store_ascii(__m128i block, uint32_t *out) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i low = _mm_unpacklo_epi8(block, zero);
+  __m128i high = _mm_unpackhi_epi8(block, zero);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_unpacklo_epi16(low, zero));
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 4), _mm_unpackhi_epi16(low, zero));
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 8), _mm_unpacklo_epi16(high, zero));
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 12), _mm_unpackhi_epi16(high, zero));
+}
+
+// Decodes 16 bytes if they are 8 valid two-byte sequences (Cyrillic, Greek,
+// Hebrew, Arabic, ...). Returns false otherwise.
+inline bool decode_two_byte_block(__m128i block, uint32_t *out) {
+  // Each 16-bit lane holds a lead byte in the low half and a continuation byte in the high half.
+  __m128i lead = _mm_and_si128(block, _mm_set1_epi16(0x00ff));
+  __m128i cont = _mm_srli_epi16(block, 8);
+  __m128i is_lead = _mm_cmpeq_epi16(_mm_and_si128(lead, _mm_set1_epi16(0xe0)), _mm_set1_epi16(0xc0));
+  // Lead bytes 0xc0 and 0xc1 give overlong sequences.
+  __m128i is_overlong = _mm_cmpeq_epi16(_mm_and_si128(lead, _mm_set1_epi16(0x1e)), _mm_setzero_si128());
+  __m128i is_cont = _mm_cmpeq_epi16(_mm_and_si128(cont, _mm_set1_epi16(0xc0)), _mm_set1_epi16(0x80));
+  __m128i valid = _mm_andnot_si128(is_overlong, _mm_and_si128(is_lead, is_cont));
+  if (_mm_movemask_epi8(valid) != 0xffff) {
+    return false;
+  }
+  __m128i code_points = _mm_or_si128(
+      _mm_slli_epi16(_mm_and_si128(lead, _mm_set1_epi16(0x1f)), 6),
+      _mm_and_si128(cont, _mm_set1_epi16(0x3f)));
+  __m128i zero = _mm_setzero_si128();
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_unpacklo_epi16(code_points, zero));
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 4), _mm_unpackhi_epi16(code_points, zero));
+  return true;
+}
+
+// Decodes one block of 16 bytes starting at `begin`, or a shorter prefix of it.
+// Returns the number of consumed bytes.
+inline uint64_t decode_block_sse2(const char *begin, const char *end, uint32_t *&out,
+                                  uint64_t *n_invalid) {
+  __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(begin));
+  uint32_t non_ascii = _mm_movemask_epi8(block);
+  if (non_ascii == 0) {
+    store_ascii(block, out);
+    out += 16;
+    return 16;
+  }
+  if (non_ascii == 0xffff && decode_two_byte_block(block, out)) {
+    out += 8;
+    return 16;
+  }
+  // Code points are written for the whole block, but only the ASCII prefix is kept.
+  uint64_t n_ascii = __builtin_ctz(non_ascii);
+  store_ascii(block, out);
+  out += n_ascii;
+  uint64_t utf8_len = 0;
+  uint32_t code_point = chars_to_utf8(begin + n_ascii, end - begin - n_ascii, &utf8_len);
+  if (code_point != INVALID_UNICODE) {
+    *out++ = code_point;
+  } else {
+    (*n_invalid)++;
+  }
+  return n_ascii + utf8_len;
+}
+
+uint64_t decode_utf8_sse2(const char *begin, const char *end, uint32_t *out,
+                          uint64_t *n_invalid) {
+  uint32_t *out_begin = out;
+  // There are at least 16 bytes left, so at least 16 code points fit into `out`.
+  while (end - begin >= 16) {
+    begin += decode_block_sse2(begin, end, out, n_invalid);
+  }
+  return out - out_begin + decode_utf8_scalar(begin, end, out, n_invalid);
+}
+
+__attribute__((target("avx2")))
+uint64_t decode_utf8_avx2(const char *begin, const char *end, uint32_t *out,
+                          uint64_t *n_invalid) {
+  uint32_t *out_begin = out;
+  while (end - begin >= 32) {
+    __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(begin));
+    if (_mm256_movemask_epi8(block) != 0) {
+      begin += decode_block_sse2(begin, end, out, n_invalid);
+      continue;
+    }
+    for (int i = 0; i < 4; i++) {
+      __m128i part = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(begin + 8 * i));
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 8 * i), _mm256_cvtepu8_epi32(part));
+    }
+    begin += 32;
+    out += 32;
+  }
+  return out - out_begin + decode_utf8_sse2(begin, end, out, n_invalid);
+}
+
+#endif
+
+DecodeFunction select_decode_function() {
+#ifdef YTTM_SIMD_UTF8
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return decode_utf8_avx2;
+  }
+  return decode_utf8_sse2;
+#else
+  return decode_utf8_scalar;
+#endif
+}
+
+const DecodeFunction decode_utf8_impl = select_decode_function();
+
+bool decode_utf8(const char* begin, const char* end, vector<uint32_t>* decoded_text,
+                 uint64_t* n_invalid) {
+  uint64_t old_size = decoded_text->size();
+  decoded_text->resize(old_size + (end - begin));
+  uint64_t invalid = 0;
+  uint64_t n_decoded = decode_utf8_impl(begin, end, decoded_text->data() + old_size, &invalid);
+  decoded_text->resize(old_size + n_decoded);
+  if (n_invalid) {
+    *n_invalid += invalid;
+  }
+  return invalid == 0;
+}
+
+const char *utf8_split_point(const char *begin, const char *end, uint64_t max_bytes) {
+  // A sequence is at most 4 bytes long, so if there are only continuation bytes
+  // after the first one, the sequence started at `begin` ends before begin + 4.
+  max_bytes = std::max<uint64_t>(max_bytes, 4);
+  if (static_cast<uint64_t>(end - begin) <= max_bytes) {
+    return end;
+  }
+  // Continuation bytes are the only ones that can belong to a sequence started earlier.
+  for (const char *pos = begin + max_bytes; pos > begin; pos--) {
+    if (!check_byte(*pos)) {
+      return pos;
     }
   }
-  if (invalid_input) {
+  return begin + max_bytes;
+}
+
+// Only the bytes below can start a space character: ASCII spaces and lead bytes
+// of the spaces outside ASCII (see utf8_space_len).
+inline bool is_space_candidate(uint8_t byte) {
+  return byte == ' ' || (byte >= '\t' && byte <= '\r') || byte == 0xc2u || byte == 0xc3u ||
+         byte == 0xe2u;
+}
+
+// Returns the first byte in [begin, end) for which is_space_candidate is true, or end.
+const char *find_space_candidate(const char *begin, const char *end) {
+#ifdef YTTM_SIMD_UTF8
+  for (; end - begin >= 16; begin += 16) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(begin));
+    // '\t', '\n', '\v', '\f' and '\r' are the bytes from 9 to 13.
+    __m128i control = _mm_sub_epi8(block, _mm_set1_epi8('\t'));
+    __m128i candidates = _mm_cmpeq_epi8(_mm_min_epu8(control, _mm_set1_epi8(4)), control);
+    candidates = _mm_or_si128(candidates, _mm_cmpeq_epi8(block, _mm_set1_epi8(' ')));
+    candidates = _mm_or_si128(candidates, _mm_cmpeq_epi8(block, _mm_set1_epi8('\xc2')));
+    candidates = _mm_or_si128(candidates, _mm_cmpeq_epi8(block, _mm_set1_epi8('\xc3')));
+    candidates = _mm_or_si128(candidates, _mm_cmpeq_epi8(block, _mm_set1_epi8('\xe2')));
+    uint32_t mask = _mm_movemask_epi8(candidates);
+    if (mask != 0) {
+      return begin + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; begin != end && !is_space_candidate(*begin); begin++) {
+  }
+  return begin;
+}
+
+const char *split_words(const char *begin, const char *end, vector<WordSpan> *words,
+                        uint64_t max_words) {
+  for (uint64_t n_words = 0; n_words < max_words; n_words++) {
+    uint64_t space_len;
+    for (; begin != end && (space_len = utf8_space_len(begin, end)) != 0; begin += space_len) {
+    }
+    if (begin == end) {
+      break;
+    }
+    // Bytes inside a utf-8 sequence are never candidates, so the search can
+    // start in the middle of the first character.
+    const char *end_of_word = begin + 1;
+    while ((end_of_word = find_space_candidate(end_of_word, end)) != end &&
+           utf8_space_len(end_of_word, end) == 0) {
+      end_of_word++;
+    }
+    words->push_back({begin, end_of_word});
+    begin = end_of_word;
+  }
+  return begin;
+}
+
+vector<uint32_t> decode_utf8(const char* begin, const char* end) {
+  vector<uint32_t> decoded_text;
+  if (!decode_utf8(begin, end, &decoded_text)) {
     std::cerr << "WARNING Input contains invalid unicode characters."
               << std::endl;
   }
@@ -16,8 +16,29 @@ std::string encode_utf8(const std::vector<uint32_t> &utext);
 
 std::vector<uint32_t> decode_utf8(const char *begin, const char *end);
 
+// Appends decoded code points to `decoded_text`. Invalid sequences are skipped,
+// their number is added to *n_invalid if it's not null. Returns false if the
+// input contained invalid sequences. Uses SSE2 or AVX2 when the CPU supports them.
+bool decode_utf8(const char *begin, const char *end, std::vector<uint32_t> *decoded_text,
+                 uint64_t *n_invalid = nullptr);
+
+// Returns a position in (begin, begin + max(max_bytes, 4)] (or end, if it's closer) such that
+// decoding [begin, pos) and [pos, end) separately gives the same result as decoding [begin, end).
+const char *utf8_split_point(const char *begin, const char *end, uint64_t max_bytes);
+
 std::vector<uint32_t> decode_utf8(const std::string &utf8_text);
 
+struct WordSpan {
+  const char *begin;
+  const char *end;
+};
+
+// Appends to `words` the maximal runs of non-space characters (see is_space) in
+// [begin, end), at most `max_words` of them. Works on utf-8 bytes, using SSE2 when
+// available. Returns `end`, or the end of the last word if `max_words` words were found.
+const char *split_words(const char *begin, const char *end, std::vector<WordSpan> *words,
+                        uint64_t max_words);
+
 struct UTF8Iterator {
   UTF8Iterator(char* begin, char* end): begin(begin), end(end) {}
 
@@ -1,9 +1,20 @@
 #include "utils.h"
+#include <algorithm>
 #include <cassert>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <string>
 #include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "utf8.h"
 
 namespace vkcom {
 
@@ -87,19 +98,290 @@ Status BPEState::load(const std::string &file_name) {
   }
   special_tokens.load(fin);
   fin.close();
+  return check();
+}
+
+Status BPEState::check() const {
+  uint64_t n_tokens = char2id.size() + rules.size() + special_tokens.n_special_tokens();
+  std::vector<uint8_t> defined(n_tokens, 0);
+  auto define = [&](uint32_t id) {
+    if (id >= n_tokens || defined[id] || special_tokens.taken_id(id)) {
+      return false;
+    }
+    defined[id] = 1;
+    return true;
+  };
+  for (const auto &x : char2id) {
+    if (!define(x.second)) {
+      return Status(1, "Invalid model: wrong id of character " + std::to_string(x.first));
+    }
+  }
+  for (const auto &rule : rules) {
+    if (rule.x >= n_tokens || rule.y >= n_tokens || !defined[rule.x] || !defined[rule.y] ||
+        !define(rule.z)) {
+      return Status(1, "Invalid model: wrong rule " + std::to_string(rule.x) + " + " +
+                           std::to_string(rule.y) + " -> " + std::to_string(rule.z));
+    }
+  }
+  return Status();
+}
+
+uint64_t BPEState::hash() const {
+  // 64-bit FNV-1a
+  uint64_t result = 14695981039346656037ull;
+  auto mix = [&](uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+      result ^= (value >> (8 * i)) & 0xFFu;
+      result *= 1099511628211ull;
+    }
+  };
+  std::vector<std::pair<uint32_t, uint32_t>> chars(char2id.begin(), char2id.end());
+  std::sort(chars.begin(), chars.end());
+  mix(chars.size());
+  for (const auto &ch : chars) {
+    mix(ch.first);
+    mix(ch.second);
+  }
+  mix(rules.size());
+  for (const auto &rule : rules) {
+    mix(rule.x);
+    mix(rule.y);
+    mix(rule.z);
+  }
+  mix(special_tokens.pad_id);
+  mix(special_tokens.unk_id);
+  mix(special_tokens.bos_id);
+  mix(special_tokens.eos_id);
+  return result;
+}
+
+static_assert(sizeof(BPE_Rule) == 12, "BPE_Rule must have no padding");
+static_assert(sizeof(ModelHeader) % 8 == 0, "Sections of a model must stay aligned");
+
+void ModelSections::set(ModelSection section, const void *data_, uint64_t size_) {
+  data[section] = static_cast<const char *>(data_);
+  size[section] = size_;
+}
+
+namespace {
+
+// Binary files are written with memcpy and fwrite, so they are little-endian
+// only when the host is.
+bool is_little_endian() {
+  uint16_t one = 1;
+  unsigned char first_byte;
+  memcpy(&first_byte, &one, 1);
+  return first_byte == 1;
+}
+
+}  // namespace
+
+bool is_binary_model(const std::string &file_name) {
+  char magic[sizeof(MODEL_MAGIC)];
+  std::ifstream fin(file_name, std::ios::in | std::ios::binary);
+  return fin.read(magic, sizeof(magic)) && memcmp(magic, MODEL_MAGIC, sizeof(magic)) == 0;
+}
+
+Status BPEState::dump_binary(const std::string &file_name,
+                             const ModelSections &sections_) const {
+  if (!is_little_endian()) {
+    return Status(1, "Binary models are supported only on little-endian hosts");
+  }
+  std::vector<std::pair<uint32_t, uint32_t>> chars;
+  for (const auto &x : char2id) {
+    chars.emplace_back(x.second, x.first);
+  }
+  std::sort(chars.begin(), chars.end());
+  std::vector<uint32_t> char_section;
+  for (const auto &x : chars) {
+    char_section.push_back(x.second);
+    char_section.push_back(x.first);
+  }
+  ModelSections sections = sections_;
+  sections.set(MODEL_CHARS, char_section.data(), char_section.size() * sizeof(uint32_t));
+  sections.set(MODEL_RULES, rules.data(), rules.size() * sizeof(BPE_Rule));
+
+  ModelHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MODEL_MAGIC, sizeof(header.magic));
+  header.version = MODEL_VERSION;
+  header.n_sections = N_MODEL_SECTIONS;
+  header.pad_id = special_tokens.pad_id;
+  header.unk_id = special_tokens.unk_id;
+  header.bos_id = special_tokens.bos_id;
+  header.eos_id = special_tokens.eos_id;
+  uint64_t offset = sizeof(header);
+  for (int i = 0; i < N_MODEL_SECTIONS; i++) {
+    header.section_offset[i] = offset;
+    header.section_size[i] = sections.size[i];
+    offset += (sections.size[i] + 7) / 8 * 8;
+  }
+
+  std::string tmp_name = file_name + ".tmp" + std::to_string(getpid());
+  FILE *file = fopen(tmp_name.c_str(), "wb");
+  if (!file) {
+    return Status(1, "Can't open file: " + file_name);
+  }
+  const char padding[8] = {};
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  for (int i = 0; i < N_MODEL_SECTIONS && ok; i++) {
+    uint64_t size = sections.size[i];
+    ok = fwrite(sections.data[i], 1, size, file) == size &&
+        fwrite(padding, 1, (8 - size % 8) % 8, file) == (8 - size % 8) % 8;
+  }
+  ok = fclose(file) == 0 && ok;
+  if (!ok || rename(tmp_name.c_str(), file_name.c_str()) != 0) {
+    remove(tmp_name.c_str());
+    return Status(1, "Failed to write file: " + file_name);
+  }
   return Status();
 }
 
+Status BPEState::load_binary(const char *data, uint64_t size, ModelSections *sections) {
+  char2id.clear();
+  rules.clear();
+  if (!is_little_endian()) {
+    return Status(1, "Binary models are supported only on little-endian hosts");
+  }
+  ModelHeader header;
+  if (size < sizeof(header)) {
+    return Status(1, "Invalid binary model: the file is too short");
+  }
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, MODEL_MAGIC, sizeof(header.magic)) != 0) {
+    return Status(1, "Invalid binary model: wrong magic number");
+  }
+  if (header.version != MODEL_VERSION || header.n_sections != N_MODEL_SECTIONS) {
+    return Status(1, "Unsupported version of binary model: " + std::to_string(header.version));
+  }
+  for (int i = 0; i < N_MODEL_SECTIONS; i++) {
+    uint64_t offset = header.section_offset[i];
+    uint64_t section_size = header.section_size[i];
+    if (offset % 8 != 0 || offset > size || section_size > size - offset) {
+      return Status(1, "Invalid binary model: section " + std::to_string(i) +
+                           " is out of the file");
+    }
+    sections->set(static_cast<ModelSection>(i), data + offset, section_size);
+  }
+  if (sections->size[MODEL_CHARS] % (2 * sizeof(uint32_t)) != 0 ||
+      sections->size[MODEL_RULES] % sizeof(BPE_Rule) != 0) {
+    return Status(1, "Invalid binary model: wrong size of characters or rules");
+  }
+
+  uint64_t n_chars = sections->size[MODEL_CHARS] / (2 * sizeof(uint32_t));
+  std::vector<uint32_t> chars(2 * n_chars);
+  memcpy(chars.data(), sections->data[MODEL_CHARS], sections->size[MODEL_CHARS]);
+  char2id.reserve(n_chars);
+  for (uint64_t i = 0; i < n_chars; i++) {
+    char2id[chars[2 * i]] = chars[2 * i + 1];
+  }
+  rules.resize(sections->size[MODEL_RULES] / sizeof(BPE_Rule));
+  memcpy(rules.data(), sections->data[MODEL_RULES], sections->size[MODEL_RULES]);
+  special_tokens = SpecialTokens(header.pad_id, header.unk_id, header.bos_id, header.eos_id);
+  return check();
+}
+
 BpeConfig::BpeConfig(double _character_coverage, int _n_threads,
                      const SpecialTokens &_special_tokens)
     : character_coverage(_character_coverage),
       n_threads(_n_threads),
       special_tokens(_special_tokens) {}
 
+ThreadPool::ThreadPool(int n_threads) : owner_pid(getpid()) {
+  for (int i = 1; i < n_threads; i++) {
+    workers.emplace_back(&ThreadPool::worker_loop, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  if (getpid() != owner_pid) {
+    // Worker threads do not exist in a forked process.
+    for (auto &worker : workers) {
+      worker.detach();
+    }
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lg(mt);
+    stop = true;
+  }
+  task_cv.notify_all();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+void ThreadPool::run_tasks() {
+  for (uint64_t i = next_task++; i < n_tasks; i = next_task++) {
+    (*task)(i);
+  }
+}
+
+void ThreadPool::worker_loop() {
+  uint64_t last_generation = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> ul(mt);
+      task_cv.wait(ul, [&] { return stop || generation != last_generation; });
+      if (stop) {
+        return;
+      }
+      last_generation = generation;
+    }
+    run_tasks();
+    {
+      std::lock_guard<std::mutex> lg(mt);
+      running--;
+    }
+    done_cv.notify_one();
+  }
+}
+
+void ThreadPool::parallel_for(uint64_t _n_tasks, const std::function<void(uint64_t)> &_task) {
+  std::unique_lock<std::mutex> run_lock(run_mt, std::try_to_lock);
+  if (workers.empty() || !run_lock.owns_lock() || getpid() != owner_pid) {
+    for (uint64_t i = 0; i < _n_tasks; i++) {
+      _task(i);
+    }
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lg(mt);
+    task = &_task;
+    n_tasks = _n_tasks;
+    next_task = 0;
+    running = workers.size();
+    generation++;
+  }
+  task_cv.notify_all();
+  run_tasks();
+  std::unique_lock<std::mutex> ul(mt);
+  done_cv.wait(ul, [&] { return running == 0; });
+  task = nullptr;
+}
+
 bool is_space(uint32_t ch) {
   return (ch < 256 && isspace(ch)) || (ch == SPACE_TOKEN);
 }
 
+uint64_t utf8_space_len(const char *begin, const char *end) {
+  auto lead = static_cast<uint8_t>(*begin);
+  if (lead < 0x80u) {
+    return isspace(lead) ? 1 : 0;
+  }
+  // Only code points below 256 and SPACE_TOKEN can be spaces.
+  // Their utf-8 encodings start with one of these bytes.
+  if (lead != 0xc2u && lead != 0xc3u && lead != 0xe2u) {
+    return 0;
+  }
+  uint64_t utf8_len;
+  uint32_t code_point = chars_to_utf8(begin, end - begin, &utf8_len);
+  if (code_point != INVALID_UNICODE && is_space(code_point)) {
+    return utf8_len;
+  }
+  return 0;
+}
+
 std::vector<std::string> read_lines_from_stdin(uint64_t batch_limit, uint64_t *processed) {
   std::vector<std::string> sentences;
   std::string s;
@@ -110,6 +392,343 @@ std::vector<std::string> read_lines_from_stdin(uint64_t batch_limit, uint64_t *p
   return sentences;
 }
 
+void parse_ints(const char *begin, const char *end, std::vector<int> *out) {
+  const char *it = begin;
+  while (true) {
+    while (it != end && isspace(static_cast<unsigned char>(*it))) {
+      ++it;
+    }
+    if (it == end) {
+      return;
+    }
+    bool negative = *it == '-';
+    if (*it == '-' || *it == '+') {
+      ++it;
+    }
+    if (it == end || !isdigit(static_cast<unsigned char>(*it))) {
+      return;
+    }
+    // Magnitude of the smallest int is the largest one plus one
+    const int64_t limit = static_cast<int64_t>(std::numeric_limits<int>::max()) + negative;
+    int64_t value = 0;
+    for (; it != end && isdigit(static_cast<unsigned char>(*it)); ++it) {
+      value = value * 10 + (*it - '0');
+      if (value > limit) {
+        return;
+      }
+    }
+    out->push_back(static_cast<int>(negative ? -value : value));
+  }
+}
+
+namespace {
+const char DIGIT_PAIRS[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+}  // namespace
+
+void append_int(int64_t value, std::string *out) {
+  char buffer[24];
+  char *end = buffer + sizeof(buffer);
+  char *pos = end;
+  uint64_t x = value < 0 ? 0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+  // Two digits per division
+  while (x >= 100) {
+    uint64_t r = x % 100;
+    x /= 100;
+    pos -= 2;
+    memcpy(pos, DIGIT_PAIRS + 2 * r, 2);
+  }
+  if (x >= 10) {
+    pos -= 2;
+    memcpy(pos, DIGIT_PAIRS + 2 * x, 2);
+  } else {
+    *--pos = static_cast<char>('0' + x);
+  }
+  if (value < 0) {
+    *--pos = '-';
+  }
+  out->append(pos, end - pos);
+}
+
+void format_sentence(const std::vector<int> &sentence, std::string *out) {
+  for (int id : sentence) {
+    append_int(id, out);
+    out->push_back(' ');
+  }
+  out->push_back('\n');
+}
+
+void format_sentence(const std::vector<std::string> &sentence, std::string *out) {
+  for (const auto &token : sentence) {
+    out->append(token);
+    out->push_back(' ');
+  }
+  out->push_back('\n');
+}
+
+void format_sentences(const std::vector<std::vector<int>> &sentences,
+                      uint64_t begin, uint64_t end, std::string *out) {
+  for (uint64_t i = begin; i < end; i++) {
+    format_sentence(sentences[i], out);
+  }
+}
+
+void format_sentences(const std::vector<std::vector<std::string>> &sentences,
+                      uint64_t begin, uint64_t end, std::string *out) {
+  for (uint64_t i = begin; i < end; i++) {
+    format_sentence(sentences[i], out);
+  }
+}
+
+BufferedWriter::BufferedWriter(FILE *file, uint64_t buffer_size)
+    : file(file), buffer_size(buffer_size) {
+  buffer.reserve(buffer_size);
+}
+
+BufferedWriter::~BufferedWriter() {
+  flush();
+}
+
+void BufferedWriter::write(const char *data, uint64_t size) {
+  if (buffer.size() + size > buffer_size) {
+    write_buffer();
+    if (size >= buffer_size) {
+      write_file(data, size);
+      return;
+    }
+  }
+  buffer.append(data, size);
+}
+
+void BufferedWriter::write_buffer() {
+  if (!buffer.empty()) {
+    write_file(buffer.data(), buffer.size());
+    buffer.clear();
+  }
+}
+
+void BufferedWriter::write_file(const char *data, uint64_t size) {
+  // After the first failure the output is incomplete anyway
+  if (!failed && fwrite(data, 1, size, file) != size) {
+    failed = true;
+  }
+}
+
+Status BufferedWriter::flush() {
+  write_buffer();
+  if (fflush(file) != 0 || ferror(file)) {
+    failed = true;
+  }
+  if (failed) {
+    return Status(1, "Failed to write the output");
+  }
+  return Status();
+}
+
+MappedFile::~MappedFile() {
+  close();
+}
+
+Status MappedFile::open(const std::string &path, bool sequential) {
+  close();
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return Status(1, "Can't open file: " + path);
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0) {
+    ::close(fd);
+    return Status(1, "Can't open file: " + path);
+  }
+  length = file_stat.st_size;
+  device = file_stat.st_dev;
+  inode = file_stat.st_ino;
+  if (length > 0) {
+    addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+      addr = nullptr;
+      length = 0;
+      ::close(fd);
+      return Status(1, "Can't map file: " + path);
+    }
+    madvise(addr, length, sequential ? MADV_SEQUENTIAL : MADV_WILLNEED);
+  }
+  ::close(fd);
+  return Status();
+}
+
+void MappedFile::close() {
+  if (addr) {
+    munmap(addr, length);
+  }
+  addr = nullptr;
+  length = 0;
+  device = 0;
+  inode = 0;
+}
+
+bool MappedFile::same_file(const std::string &path) const {
+  struct stat file_stat;
+  return inode != 0 && stat(path.c_str(), &file_stat) == 0 &&
+      static_cast<uint64_t>(file_stat.st_dev) == device &&
+      static_cast<uint64_t>(file_stat.st_ino) == inode;
+}
+
+PositionalFile::~PositionalFile() {
+  close();
+}
+
+Status PositionalFile::open(const std::string &path_) {
+  Status status = close();
+  if (!status.ok()) {
+    return status;
+  }
+  path = path_;
+  fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    return Status(1, "Can't open file: " + path);
+  }
+  return Status();
+}
+
+Status PositionalFile::write_at(const char *data, uint64_t size, uint64_t offset) const {
+  while (size > 0) {
+    ssize_t written = pwrite(fd, data, size, offset);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return Status(1, "Failed to write file: " + path);
+    }
+    data += written;
+    size -= written;
+    offset += written;
+  }
+  return Status();
+}
+
+Status PositionalFile::close() {
+  if (fd == -1) {
+    return Status();
+  }
+  int result = ::close(fd);
+  fd = -1;
+  if (result != 0) {
+    return Status(1, "Failed to write file: " + path);
+  }
+  return Status();
+}
+
+static_assert(sizeof(DatasetHeader) == 48, "DatasetHeader must have no padding");
+
+DatasetWriter::~DatasetWriter() {
+  close();
+}
+
+Status DatasetWriter::open(const std::string &path_, uint32_t id_size,
+                           uint64_t model_hash, const SpecialTokens &special_tokens) {
+  assert(id_size == 2 || id_size == 4);
+  Status status = close();
+  if (!status.ok()) {
+    return status;
+  }
+  if (!is_little_endian()) {
+    return Status(1, "Binary datasets are supported only on little-endian hosts");
+  }
+  path = path_;
+  memcpy(header.magic, DATASET_MAGIC, sizeof(header.magic));
+  header.version = DATASET_VERSION;
+  header.id_size = id_size;
+  header.model_hash = model_hash;
+  header.pad_id = special_tokens.pad_id;
+  header.unk_id = special_tokens.unk_id;
+  header.bos_id = special_tokens.bos_id;
+  header.eos_id = special_tokens.eos_id;
+  header.n_sentences = 0;
+  n_ids = 0;
+
+  data_file = fopen(path.c_str(), "wb");
+  index_file = fopen((path + ".idx").c_str(), "wb");
+  if (!data_file || !index_file) {
+    close();
+    return Status(1, "Can't open file: " + path);
+  }
+  // The header is rewritten with the final number of sentences by close
+  uint64_t first_offset = 0;
+  if (fwrite(&header, sizeof(header), 1, index_file) != 1 ||
+      fwrite(&first_offset, sizeof(first_offset), 1, index_file) != 1) {
+    return write_error();
+  }
+  return Status();
+}
+
+Status DatasetWriter::write(const std::vector<std::vector<int>> &sentences) {
+  assert(data_file && index_file);
+  uint64_t batch_ids = 0;
+  for (const auto &sentence : sentences) {
+    batch_ids += sentence.size();
+  }
+  id_buffer.resize(batch_ids * header.id_size);
+  offsets.resize(sentences.size());
+  char *pos = id_buffer.data();
+  for (uint64_t i = 0; i < sentences.size(); i++) {
+    if (header.id_size == 2) {
+      for (int id : sentences[i]) {
+        assert(0 <= id && id <= std::numeric_limits<uint16_t>::max());
+        auto value = static_cast<uint16_t>(id);
+        memcpy(pos, &value, sizeof(value));
+        pos += sizeof(value);
+      }
+    } else {
+      for (int id : sentences[i]) {
+        assert(0 <= id);
+        auto value = static_cast<uint32_t>(id);
+        memcpy(pos, &value, sizeof(value));
+        pos += sizeof(value);
+      }
+    }
+    n_ids += sentences[i].size();
+    offsets[i] = n_ids;
+  }
+  if (fwrite(id_buffer.data(), 1, id_buffer.size(), data_file) != id_buffer.size() ||
+      fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), index_file) != offsets.size()) {
+    return write_error();
+  }
+  header.n_sentences += sentences.size();
+  return Status();
+}
+
+Status DatasetWriter::close() {
+  if (!data_file && !index_file) {
+    return Status();
+  }
+  bool ok = data_file && index_file;
+  if (ok) {
+    ok = fseek(index_file, 0, SEEK_SET) == 0 &&
+        fwrite(&header, sizeof(header), 1, index_file) == 1;
+  }
+  if (data_file) {
+    ok = fclose(data_file) == 0 && ok;
+    data_file = nullptr;
+  }
+  if (index_file) {
+    ok = fclose(index_file) == 0 && ok;
+    index_file = nullptr;
+  }
+  if (!ok) {
+    return write_error();
+  }
+  return Status();
+}
+
+Status DatasetWriter::write_error() const {
+  return Status(1, "Failed to write dataset: " + path);
+}
+
 Status::Status(int code, std::string message) : code(code), message(std::move(message)) {}
 
 const std::string &Status::error_message() const {
@@ -1,7 +1,15 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 #include "third_party/flat_hash_map.h"
 
@@ -63,6 +71,61 @@ struct Status {
   bool ok() const;
 };
 
+// Sections of a binary model file, in the order in which they are stored.
+enum ModelSection {
+  // Pairs (code point, id) of all characters, sorted by id.
+  MODEL_CHARS,
+  // BPE_Rule of all rules.
+  MODEL_RULES,
+  // Lookup tables of BaseEncoder.
+  MODEL_RULE_DENSE,
+  MODEL_RULE_SLOTS,
+  MODEL_CHAR_DENSE,
+  MODEL_CHAR_SPARSE,
+  MODEL_PIECE_POOL,
+  MODEL_PIECE_OFFSETS,
+  MODEL_DECODE_POOL,
+  MODEL_DECODE_OFFSETS,
+  MODEL_PIECE_INDEX,
+  MODEL_TOKEN_CHAR_POOL,
+  MODEL_TOKEN_CHAR_OFFSETS,
+  MODEL_MERGE_TREE,
+  N_MODEL_SECTIONS
+};
+
+// A binary model file consists of the header and the sections listed in it.
+// Every section starts at an offset aligned to 8 bytes, numbers are
+// little-endian: the file is written as is from memory, so BPEState refuses to
+// dump or load it on a big-endian host. Besides the model itself the file
+// holds the lookup tables built by BaseEncoder, so loading the model doesn't
+// have to build them again. The encoder uses the tables right in the mapped
+// file, which is shared by all processes that load the model.
+struct ModelHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t n_sections;
+  int32_t pad_id;
+  int32_t unk_id;
+  int32_t bos_id;
+  int32_t eos_id;
+  uint64_t section_offset[N_MODEL_SECTIONS];
+  uint64_t section_size[N_MODEL_SECTIONS];
+};
+
+const char MODEL_MAGIC[8] = {'Y', 'T', 'T', 'M', 'M', 'O', 'D', 'L'};
+const uint32_t MODEL_VERSION = 3;
+
+// Byte ranges of the sections of a binary model.
+struct ModelSections {
+  const char *data[N_MODEL_SECTIONS] = {};
+  uint64_t size[N_MODEL_SECTIONS] = {};
+
+  void set(ModelSection section, const void *data, uint64_t size);
+};
+
+// True if the file starts with MODEL_MAGIC.
+bool is_binary_model(const std::string &file_name);
+
 struct BPEState {
   flat_hash_map<uint32_t, uint32_t> char2id;
   std::vector<BPE_Rule> rules;
@@ -71,6 +134,24 @@ struct BPEState {
   void dump(const std::string &file_name);
 
   Status load(const std::string &file_name);
+
+  // Checks that ids of characters and tokens are below the size of the
+  // vocabulary and that every rule merges characters or results of the rules
+  // before it.
+  Status check() const;
+
+  // Writes the model in the binary format. MODEL_CHARS and MODEL_RULES are
+  // written from the state, the other sections are taken from `sections`.
+  // The file is written under a temporary name and then renamed, so that
+  // processes loading the model never see a partly written file.
+  Status dump_binary(const std::string &file_name, const ModelSections &sections) const;
+
+  // Reads the model from a binary model file mapped to [data, data + size).
+  // `sections` receives the byte ranges of all sections of the file.
+  Status load_binary(const char *data, uint64_t size, ModelSections *sections);
+
+  // Hash of the model contents, it doesn't depend on the order of char2id.
+  uint64_t hash() const;
 };
 
 struct DecodeResult {
@@ -83,23 +164,312 @@ struct EncodingConfig {
   bool eos;
   bool reverse;
   double dropout_prob;
+  // random state of the i-th sentence is derived from dropout_seed and i
+  uint64_t dropout_seed;
+};
+
+class ThreadPool {
+ public:
+  // Starts n_threads - 1 workers, the thread calling parallel_for is used as well.
+  explicit ThreadPool(int n_threads);
+
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  // Runs task(i) for every i in [0, n_tasks). Tasks are taken one by one by
+  // whichever thread is free. If the pool is busy with another call (or the
+  // process was forked after the pool was created), all tasks are run by the
+  // calling thread.
+  void parallel_for(uint64_t n_tasks, const std::function<void(uint64_t)> &task);
+
+ private:
+  std::vector<std::thread> workers;
+  int owner_pid;
+
+  std::mutex run_mt;
+  std::mutex mt;
+  std::condition_variable task_cv;
+  std::condition_variable done_cv;
+  const std::function<void(uint64_t)> *task{nullptr};
+  uint64_t n_tasks{0};
+  std::atomic<uint64_t> next_task{0};
+  uint64_t generation{0};
+  uint64_t running{0};
+  bool stop{false};
+
+  void run_tasks();
+
+  void worker_loop();
+};
+
+// FIFO queue of limited capacity connecting the stages of a pipeline. push
+// blocks while the queue is full and pop blocks while it is empty, so a fast
+// stage waits for a slow one instead of buffering unboundedly. After close,
+// push fails and pop drains the remaining elements and then fails.
+template<typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(uint64_t capacity) : capacity(capacity) {}
+
+  BoundedQueue(const BoundedQueue &) = delete;
+
+  BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+  bool push(T value) {
+    std::unique_lock<std::mutex> ul(mt);
+    not_full.wait(ul, [&] { return closed || items.size() < capacity; });
+    if (closed) {
+      return false;
+    }
+    items.push_back(std::move(value));
+    not_empty.notify_one();
+    return true;
+  }
+
+  bool pop(T *value) {
+    std::unique_lock<std::mutex> ul(mt);
+    not_empty.wait(ul, [&] { return closed || !items.empty(); });
+    if (items.empty()) {
+      return false;
+    }
+    *value = std::move(items.front());
+    items.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lg(mt);
+    closed = true;
+    not_full.notify_all();
+    not_empty.notify_all();
+  }
+
+ private:
+  const uint64_t capacity;
+  std::mutex mt;
+  std::condition_variable not_full;
+  std::condition_variable not_empty;
+  std::deque<T> items;
+  bool closed{false};
+};
+
+// Header of the index file of a binary tokenized dataset. The dataset at
+// `path` consists of two files: `path` holds the ids of all sentences one
+// after another as little-endian integers of id_size bytes, `path + ".idx"`
+// holds the header followed by n_sentences + 1 uint64 offsets. The ids of
+// sentence i are [offsets[i], offsets[i + 1]). DatasetWriter writes the
+// numbers as they are in memory and refuses to open on a big-endian host.
+struct DatasetHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t id_size;
+  uint64_t model_hash;
+  int32_t pad_id;
+  int32_t unk_id;
+  int32_t bos_id;
+  int32_t eos_id;
+  uint64_t n_sentences;
+};
+
+const char DATASET_MAGIC[8] = {'Y', 'T', 'T', 'M', 'D', 'A', 'T', 'A'};
+const uint32_t DATASET_VERSION = 1;
+
+class DatasetWriter {
+ public:
+  DatasetWriter() = default;
+
+  ~DatasetWriter();
+
+  DatasetWriter(const DatasetWriter &) = delete;
+
+  DatasetWriter &operator=(const DatasetWriter &) = delete;
+
+  // id_size is 2 or 4, every id written must fit into it.
+  Status open(const std::string &path, uint32_t id_size, uint64_t model_hash,
+              const SpecialTokens &special_tokens);
+
+  // Appends the sentences to the dataset.
+  Status write(const std::vector<std::vector<int>> &sentences);
+
+  // Writes the header. The dataset can't be read before it is closed.
+  Status close();
+
+ private:
+  std::string path;
+  FILE *data_file{nullptr};
+  FILE *index_file{nullptr};
+  DatasetHeader header;
+  uint64_t n_ids{0};
+  std::vector<char> id_buffer;
+  std::vector<uint64_t> offsets;
+
+  Status write_error() const;
 };
 
 bool is_space(uint32_t ch);
 
+// Byte length of the utf-8 encoded space character (see is_space) starting at
+// `begin`, or 0 if the character starting at `begin` is not a space.
+uint64_t utf8_space_len(const char *begin, const char *end);
+
 std::vector<std::string> read_lines_from_stdin(uint64_t batch_limit, uint64_t *processed);
 
+// Appends the integers separated by whitespace in [begin, end) to out. As with
+// operator>> of a stream, parsing stops at the first token that isn't an int.
+void parse_ints(const char *begin, const char *end, std::vector<int> *out);
+
+// Appends the decimal representation of value to out.
+void append_int(int64_t value, std::string *out);
+
+// Appends the sentence to out in the format of the command line tools: every
+// token is followed by a space, the sentence by a newline.
+void format_sentence(const std::vector<int> &sentence, std::string *out);
+
+void format_sentence(const std::vector<std::string> &sentence, std::string *out);
+
+// Appends sentences[begin, end) to out, see format_sentence.
+void format_sentences(const std::vector<std::vector<int>> &sentences,
+                      uint64_t begin, uint64_t end, std::string *out);
+
+void format_sentences(const std::vector<std::vector<std::string>> &sentences,
+                      uint64_t begin, uint64_t end, std::string *out);
+
+// Buffered output to a FILE that bypasses iostreams. Small writes are
+// collected in a buffer, large ones are passed to fwrite as they are.
+// Must not be mixed with writes to std::cout. Flushes on destruction.
+class BufferedWriter {
+ public:
+  explicit BufferedWriter(FILE *file = stdout, uint64_t buffer_size = 1 << 20);
+
+  ~BufferedWriter();
+
+  BufferedWriter(const BufferedWriter &) = delete;
+
+  BufferedWriter &operator=(const BufferedWriter &) = delete;
+
+  void write(const char *data, uint64_t size);
+
+  void write(const std::string &data) { write(data.data(), data.size()); }
+
+  // Passes the buffered data to fwrite and flushes the file. Returns an error
+  // if any write to the file has failed since the writer was created.
+  Status flush();
+
+ private:
+  FILE *file;
+  std::string buffer;
+  uint64_t buffer_size;
+  bool failed{false};
+
+  void write_buffer();
+
+  void write_file(const char *data, uint64_t size);
+};
+
+// Array that either owns its elements or refers to elements owned by someone
+// else, such as a section of a mapped binary model.
 template<typename T>
-void write_to_stdout(const std::vector<std::vector<T>> &sentences, bool flush) {
-  for (const auto &sentence : sentences) {
-    for (const auto &token : sentence) {
-      std::cout << token << " ";
-    }
-    std::cout << "\n";
+class MappedArray {
+ public:
+  MappedArray() = default;
+
+  // A moved vector keeps its buffer, so begin_ stays valid.
+  MappedArray(MappedArray &&other) noexcept = default;
+
+  MappedArray &operator=(MappedArray &&other) noexcept = default;
+
+  MappedArray(const MappedArray &) = delete;
+
+  MappedArray &operator=(const MappedArray &) = delete;
+
+  void assign(std::vector<T> values) {
+    owned = std::move(values);
+    begin_ = owned.data();
+    size_ = owned.size();
   }
-  if (flush) {
-    std::cout << std::flush;
+
+  // The elements must outlive the array.
+  void refer(const T *data, uint64_t size) {
+    std::vector<T>().swap(owned);
+    begin_ = data;
+    size_ = size;
   }
-}
+
+  const T &operator[](uint64_t i) const { return begin_[i]; }
+
+  const T *data() const { return begin_; }
+
+  const T *begin() const { return begin_; }
+
+  const T *end() const { return begin_ + size_; }
+
+  uint64_t size() const { return size_; }
+
+  bool empty() const { return size_ == 0; }
+
+ private:
+  std::vector<T> owned;
+  const T *begin_{nullptr};
+  uint64_t size_{0};
+};
+
+// Read-only memory mapping of a whole file. Pages of the file are shared with
+// the page cache and with all other processes that map it.
+class MappedFile {
+ public:
+  MappedFile() = default;
+
+  ~MappedFile();
+
+  MappedFile(const MappedFile &) = delete;
+
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  // If sequential is false, the whole file is read ahead for random access.
+  Status open(const std::string &path, bool sequential = true);
+
+  void close();
+
+  const char *data() const { return static_cast<const char *>(addr); }
+
+  uint64_t size() const { return length; }
+
+  // True if path refers to the opened file, checked by device and inode.
+  bool same_file(const std::string &path) const;
+
+ private:
+  void *addr{nullptr};
+  uint64_t length{0};
+  uint64_t device{0};
+  uint64_t inode{0};
+};
+
+// Output file written with positional writes, so that several threads can
+// write their parts of the output at known offsets at the same time.
+class PositionalFile {
+ public:
+  PositionalFile() = default;
+
+  ~PositionalFile();
+
+  PositionalFile(const PositionalFile &) = delete;
+
+  PositionalFile &operator=(const PositionalFile &) = delete;
+
+  // Creates the file or truncates an existing one.
+  Status open(const std::string &path);
+
+  Status write_at(const char *data, uint64_t size, uint64_t offset) const;
+
+  Status close();
+
+ private:
+  std::string path;
+  int fd{-1};
+};
 
 }  // namespace vkcom
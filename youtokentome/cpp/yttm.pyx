@@ -1,7 +1,10 @@
+from libc.stdint cimport int32_t, int64_t, uint16_t, uint64_t
 from libcpp.vector cimport vector
 from libcpp.unordered_set cimport unordered_set
 from libcpp.string cimport string
 from libcpp cimport bool
+from cpython.bytes cimport PyBytes_AS_STRING, PyBytes_GET_SIZE
+from cpython.unicode cimport PyUnicode_DecodeUTF8
 import os
 from pathlib import Path
 from typing import Collection
@@ -24,29 +27,264 @@ cdef extern from "bpe.h" namespace "vkcom":
         int code
         string message
 
+    cdef cppclass EncoderConfig:
+        uint64_t cache_size
+
+    cdef cppclass SubwordView:
+        const char* data
+        uint64_t size
+
+    cdef cppclass SentenceView:
+        const char* data
+        uint64_t size
+
+    cdef cppclass SentenceBatch:
+        SentenceBatch()
+        SentenceBatch(const SentenceView* views, uint64_t n_sentences)
+        SentenceBatch(const char* data, const uint64_t* offsets, uint64_t n_sentences)
+        uint64_t size()
+
+    cdef cppclass SubwordViews:
+        vector[vector[SubwordView]] pieces
+
+    cdef cppclass CacheStats:
+        uint64_t hits
+        uint64_t misses
+        uint64_t entries
+        uint64_t memory
+
+
+cdef extern from "Python.h":
+    bint PyUnicode_IS_ASCII(object unicode)
+    const char* PyUnicode_AsUTF8AndSize(object unicode, Py_ssize_t* size) except NULL
+
 
 cdef extern from "bpe.h" namespace "vkcom":
     Status train_bpe(const string &source_path, const string& model_path, int vocab_size, const BpeConfig& bpe_config)
 
-cdef extern from "bpe.h" namespace "vkcom":
+cdef extern from "bpe.h" namespace "vkcom" nogil:
     cdef cppclass BaseEncoder:
-        BaseEncoder(const string& model_path, int n_threads, Status* status)
+        BaseEncoder(const string& model_path, int n_threads, Status* status, const EncoderConfig& config)
 
-        Status encode_as_ids(const vector[string] &sentences, vector[vector[int]]* ids, bool bos, bool eos, bool reverse, double dropout_prob) const
-        Status encode_as_subwords(const vector[string]& sentences, vector[vector[string]]* subwords, bool bos, bool eos, bool reverse, double dropout_prob) const
+        Status encode_as_ids(const SentenceBatch& sentences, vector[vector[int]]* ids, bool bos, bool eos, bool reverse, double dropout_prob, int64_t dropout_seed) const
+        Status encode_as_subword_views(const SentenceBatch& sentences, SubwordViews* subwords, bool bos, bool eos, bool reverse, double dropout_prob, int64_t dropout_seed) const
+        Status encode_as_ids_flat(const SentenceBatch& sentences, vector[int]* ids, vector[uint64_t]* offsets, bool bos, bool eos, bool reverse, double dropout_prob, int64_t dropout_seed) const
+        Status encode_as_ids_flat_uint16 "encode_as_ids_flat"(const SentenceBatch& sentences, vector[uint16_t]* ids, vector[uint64_t]* offsets, bool bos, bool eos, bool reverse, double dropout_prob, int64_t dropout_seed) const
+        Status encode_as_ids_fixed(const SentenceBatch& sentences, uint64_t max_len, bool truncate_left, int* matrix, uint64_t* lengths, bool bos, bool eos, bool reverse, double dropout_prob, int64_t dropout_seed) const
+        Status encode_as_ids_fixed_uint16 "encode_as_ids_fixed"(const SentenceBatch& sentences, uint64_t max_len, bool truncate_left, uint16_t* matrix, uint64_t* lengths, bool bos, bool eos, bool reverse, double dropout_prob, int64_t dropout_seed) const
+        Status encode_as_ids_samples(const SentenceBatch& sentences, uint64_t n_samples, vector[int]* ids, vector[uint64_t]* offsets, bool bos, bool eos, bool reverse, double dropout_prob, int64_t dropout_seed) const
+        Status encode_as_ids_padded(const SentenceBatch& sentences, vector[int]* matrix, vector[uint64_t]* lengths, uint64_t* max_len, bool bos, bool eos, bool reverse, double dropout_prob, int64_t dropout_seed) const
+        Status encode_as_ids_padded_uint16 "encode_as_ids_padded"(const SentenceBatch& sentences, vector[uint16_t]* matrix, vector[uint64_t]* lengths, uint64_t* max_len, bool bos, bool eos, bool reverse, double dropout_prob, int64_t dropout_seed) const
 
-        Status encode_cli(string output_type, bool stream, bool bos, bool eos, bool reverse, double dropout_prob) const
+        Status encode_cli(string output_type, bool stream, bool bos, bool eos, bool reverse, double dropout_prob, int64_t dropout_seed, string input_path, string output_path) const
 
         Status decode_cli(const unordered_set[int]* ignore_ids) const
 
         void vocab_cli(bool verbose) const
 
+        uint64_t model_hash() const
+
+        Status dump_binary(const string& path) const
+
         Status id_to_subword(int id, string* subword) const
 
         int subword_to_id(const string &subword) const
         Status decode(const vector[vector[int]]& ids, vector[string]* output, const unordered_set[int]* ignore_ids) const
         int vocab_size() const
         vector[string] vocabulary() const
+        CacheStats cache_stats() const
+
+
+cdef int64_t dropout_seed_value(object dropout_seed) except? -2:
+    if dropout_seed is None:
+        return -1
+    if dropout_seed < 0:
+        raise ValueError("dropout_seed must be non-negative. Current value of dropout_seed = " + str(dropout_seed))
+    return dropout_seed
+
+
+cdef list views_to_list(const vector[SubwordView]& pieces):
+    return [PyUnicode_DecodeUTF8(pieces[i].data, pieces[i].size, NULL) for i in range(pieces.size())]
+
+
+cdef class PackedSentences:
+    """Sentences stored one after another in a single buffer of UTF-8 bytes, the i-th sentence is
+    data[offsets[i]:offsets[i + 1]] as in a string column of Apache Arrow. data is any contiguous
+    buffer, offsets is a buffer of len(sentences) + 1 integers of 4 or 8 bytes. Both are read in
+    place, offsets of 4 bytes are widened once."""
+    cdef const unsigned char[::1] data
+    cdef const uint64_t[::1] offsets
+    cdef vector[uint64_t] wide_offsets
+    cdef const uint64_t* offsets_data
+    cdef uint64_t n_sentences
+
+    def __init__(self, data, offsets):
+        cdef const int32_t[::1] offsets32
+        cdef uint64_t i
+        self.data = memoryview(data).cast("B")
+        offsets = memoryview(offsets)
+        if offsets.ndim != 1 or len(offsets) == 0:
+            raise ValueError("offsets must be a one-dimensional buffer of len(sentences) + 1 elements")
+        if offsets.format.lstrip("@=") not in ["i", "I", "l", "L", "q", "Q", "n", "N"]:
+            raise TypeError("offsets must be integers. Current format of offsets = " + offsets.format)
+        if offsets.itemsize == 8:
+            self.offsets = offsets.cast("B").cast("Q")
+            self.offsets_data = &self.offsets[0]
+        elif offsets.itemsize == 4:
+            offsets32 = offsets.cast("B").cast("i")
+            self.wide_offsets.resize(offsets32.shape[0])
+            for i in range(self.wide_offsets.size()):
+                if offsets32[i] < 0:
+                    raise ValueError("offsets must be non-negative")
+                self.wide_offsets[i] = offsets32[i]
+            self.offsets_data = self.wide_offsets.data()
+        else:
+            raise TypeError("offsets must be integers of 4 or 8 bytes")
+        self.n_sentences = len(offsets) - 1
+        for i in range(self.n_sentences + 1):
+            if self.offsets_data[i] > <uint64_t>self.data.shape[0] or (i > 0 and self.offsets_data[i] < self.offsets_data[i - 1]):
+                raise ValueError("offsets must be non-decreasing and not greater than len(data)")
+
+    def __len__(self):
+        return self.n_sentences
+
+    cdef SentenceBatch batch(self):
+        cdef const char* data = NULL
+        if self.data.shape[0] > 0:
+            data = <const char*>&self.data[0]
+        return SentenceBatch(data, self.offsets_data, self.n_sentences)
+
+
+cdef class Sentences:
+    """Sentences given to the encoder. Keeps alive the objects that own the bytes of the sentences
+    while the encoder reads them in place."""
+    cdef vector[SentenceView] views
+    cdef list owners
+    cdef SentenceBatch batch
+
+
+cdef Sentences read_sentences(object sentences):
+    """Reads a sentence or a list of sentences, which are str, bytes or other buffers of UTF-8 bytes,
+    or PackedSentences. Only str with characters other than ASCII is copied, to be encoded."""
+    cdef Sentences result = Sentences()
+    cdef PackedSentences packed
+    cdef const unsigned char[::1] buffer
+    cdef Py_ssize_t size
+    if isinstance(sentences, PackedSentences):
+        packed = sentences
+        result.owners = [packed]
+        result.batch = packed.batch()
+        return result
+    if isinstance(sentences, (str, bytes)):
+        sentences = [sentences]
+    assert isinstance(sentences, list) or isinstance(sentences, tuple)
+    result.owners = []
+    result.views.resize(len(sentences))
+    for i, sentence in enumerate(sentences):
+        if isinstance(sentence, str):
+            if PyUnicode_IS_ASCII(sentence):
+                # Characters of an ASCII string are stored as its UTF-8 bytes.
+                result.views[i].data = PyUnicode_AsUTF8AndSize(sentence, &size)
+                result.views[i].size = size
+                result.owners.append(sentence)
+                continue
+            sentence = sentence.encode()
+        if isinstance(sentence, bytes):
+            result.views[i].data = PyBytes_AS_STRING(sentence)
+            result.views[i].size = PyBytes_GET_SIZE(sentence)
+        else:
+            buffer = memoryview(sentence).cast("B")
+            sentence = buffer
+            result.views[i].data = <const char*>&buffer[0] if buffer.shape[0] > 0 else NULL
+            result.views[i].size = buffer.shape[0]
+        result.owners.append(sentence)
+    result.batch = SentenceBatch(result.views.data(), result.views.size())
+    return result
+
+
+cdef void fill_buffer(Py_buffer *buffer, object owner, void *data, Py_ssize_t itemsize, char *format,
+                      int ndim, Py_ssize_t *shape, Py_ssize_t *strides):
+    buffer.buf = data
+    buffer.format = format
+    buffer.internal = NULL
+    buffer.itemsize = itemsize
+    buffer.len = itemsize
+    for i in range(ndim):
+        buffer.len *= shape[i]
+    buffer.ndim = ndim
+    buffer.obj = owner
+    buffer.readonly = 0
+    buffer.shape = shape
+    buffer.strides = strides
+    buffer.suboffsets = NULL
+
+
+cdef class IntBuffer:
+    """Owns a C++ vector of ids and exposes it through the buffer protocol without copying.
+    The vector is viewed as a matrix if reshape was called, otherwise as a flat array."""
+    cdef vector[int] data
+    cdef int ndim
+    cdef Py_ssize_t shape[2]
+    cdef Py_ssize_t strides[2]
+
+    cdef reshape(self, Py_ssize_t rows, Py_ssize_t cols):
+        self.ndim = 2
+        self.shape[0] = rows
+        self.shape[1] = cols
+
+    def __getbuffer__(self, Py_buffer *buffer, int flags):
+        if self.ndim == 2:
+            self.strides[0] = self.shape[1] * sizeof(int)
+            self.strides[1] = sizeof(int)
+        else:
+            self.ndim = 1
+            self.shape[0] = self.data.size()
+            self.strides[0] = sizeof(int)
+        fill_buffer(buffer, self, self.data.data(), sizeof(int), 'i', self.ndim, self.shape, self.strides)
+
+    def __releasebuffer__(self, Py_buffer *buffer):
+        pass
+
+
+cdef class UInt16Buffer:
+    """Same as IntBuffer, for ids stored as uint16."""
+    cdef vector[uint16_t] data
+    cdef int ndim
+    cdef Py_ssize_t shape[2]
+    cdef Py_ssize_t strides[2]
+
+    cdef reshape(self, Py_ssize_t rows, Py_ssize_t cols):
+        self.ndim = 2
+        self.shape[0] = rows
+        self.shape[1] = cols
+
+    def __getbuffer__(self, Py_buffer *buffer, int flags):
+        if self.ndim == 2:
+            self.strides[0] = self.shape[1] * sizeof(uint16_t)
+            self.strides[1] = sizeof(uint16_t)
+        else:
+            self.ndim = 1
+            self.shape[0] = self.data.size()
+            self.strides[0] = sizeof(uint16_t)
+        fill_buffer(buffer, self, self.data.data(), sizeof(uint16_t), 'H', self.ndim, self.shape, self.strides)
+
+    def __releasebuffer__(self, Py_buffer *buffer):
+        pass
+
+
+cdef class UInt64Buffer:
+    """Owns a C++ vector of offsets or lengths and exposes it through the buffer protocol without copying."""
+    cdef vector[uint64_t] data
+    cdef Py_ssize_t shape[1]
+    cdef Py_ssize_t strides[1]
+
+    def __getbuffer__(self, Py_buffer *buffer, int flags):
+        self.shape[0] = self.data.size()
+        self.strides[0] = sizeof(uint64_t)
+        fill_buffer(buffer, self, self.data.data(), sizeof(uint64_t), 'Q', 1, self.shape, self.strides)
+
+    def __releasebuffer__(self, Py_buffer *buffer):
+        pass
 
 
 cdef class BPE:
@@ -55,9 +293,13 @@ cdef class BPE:
     def __dealloc__(self):
         del self.encoder
 
-    def __init__(self, model_path, n_threads=-1):
+    def __init__(self, model_path, n_threads=-1, cache_size=0):
         cdef Status status
-        self.encoder = new BaseEncoder(model_path.encode(), n_threads, &status)
+        cdef EncoderConfig config
+        if cache_size < 0:
+            raise ValueError("cache_size must be non-negative. Current value of cache_size = " + str(cache_size))
+        config.cache_size = cache_size
+        self.encoder = new BaseEncoder(model_path.encode(), n_threads, &status, config)
         if status.code != 0:
             raise ValueError(status.message.decode())
 
@@ -84,45 +326,176 @@ cdef class BPE:
         if status.code != 0:
             raise ValueError(status.message.decode())
 
-    def encode(self, sentences, output_type, bos, eos, reverse, dropout_prob):
-        cdef vector[string] s
-        cdef vector[vector[string]] ret_subwords
+    def encode(self, sentences, output_type, bool bos, bool eos, bool reverse, double dropout_prob, dropout_seed=None):
+        cdef Sentences s
+        cdef SubwordViews ret_subwords
         cdef vector[vector[int]] ret_ids
         cdef Status status
         if dropout_prob < 0 or dropout_prob > 1:
             raise ValueError("dropout_prob value must be in the range [0, 1]. Current value of dropout_prob = " + str(dropout_prob))
+        cdef int64_t seed = dropout_seed_value(dropout_seed)
         if output_type == 'id':
-            if isinstance(sentences, str):
-                s = [sentences.encode()]
-                status = self.encoder.encode_as_ids(s, &ret_ids, bos, eos, reverse, dropout_prob)
+            if isinstance(sentences, (str, bytes)):
+                s = read_sentences(sentences)
+                with nogil:
+                    status = self.encoder.encode_as_ids(s.batch, &ret_ids, bos, eos, reverse, dropout_prob, seed)
                 if status.code != 0:
                     raise ValueError(status.message.decode())
                 return ret_ids[0]
 
-            assert isinstance(sentences, list) or isinstance(sentences, tuple)
-            s = [x.encode() for x in sentences]
-            status = self.encoder.encode_as_ids(s, &ret_ids, bos, eos, reverse, dropout_prob)
+            s = read_sentences(sentences)
+            with nogil:
+                status = self.encoder.encode_as_ids(s.batch, &ret_ids, bos, eos, reverse, dropout_prob, seed)
             if status.code != 0:
                 raise ValueError(status.message.decode())
             return ret_ids
         elif output_type == 'subword':
-            if isinstance(sentences, str):
-                s = [sentences.encode()]
-                status = self.encoder.encode_as_subwords(s, &ret_subwords, bos, eos, reverse, dropout_prob)
+            if isinstance(sentences, (str, bytes)):
+                s = read_sentences(sentences)
+                with nogil:
+                    status = self.encoder.encode_as_subword_views(s.batch, &ret_subwords, bos, eos, reverse, dropout_prob, seed)
                 if status.code != 0:
                     raise ValueError(status.message.decode())
-                assert len(ret_subwords) == 1
-                return [piece.decode() for piece in ret_subwords[0]]
+                assert ret_subwords.pieces.size() == 1
+                return views_to_list(ret_subwords.pieces[0])
 
-            assert isinstance(sentences, list) or isinstance(sentences, tuple)
-            s = [x.encode() for x in sentences]
-            status = self.encoder.encode_as_subwords(s, &ret_subwords, bos, eos, reverse, dropout_prob)
+            s = read_sentences(sentences)
+            with nogil:
+                status = self.encoder.encode_as_subword_views(s.batch, &ret_subwords, bos, eos, reverse, dropout_prob, seed)
             if status.code != 0:
                 raise ValueError(status.message.decode())
-            return [[piece.decode() for piece in sentence] for sentence in ret_subwords]
+            return [views_to_list(ret_subwords.pieces[i]) for i in range(ret_subwords.pieces.size())]
         else:
             raise ValueError('output_type must be equal to "id" or "subword"')
 
+    def encode_flat(self, sentences, bool bos, bool eos, bool reverse, double dropout_prob, dropout_seed=None, dtype="int32"):
+        cdef Sentences s
+        cdef IntBuffer ids
+        cdef UInt16Buffer ids16
+        cdef UInt64Buffer offsets = UInt64Buffer()
+        cdef Status status
+        if dropout_prob < 0 or dropout_prob > 1:
+            raise ValueError("dropout_prob value must be in the range [0, 1]. Current value of dropout_prob = " + str(dropout_prob))
+        cdef int64_t seed = dropout_seed_value(dropout_seed)
+        s = read_sentences(sentences)
+        if dtype == "int32":
+            ids = IntBuffer()
+            with nogil:
+                status = self.encoder.encode_as_ids_flat(s.batch, &ids.data, &offsets.data, bos, eos, reverse, dropout_prob, seed)
+            if status.code != 0:
+                raise ValueError(status.message.decode())
+            return memoryview(ids), memoryview(offsets)
+        elif dtype == "uint16":
+            ids16 = UInt16Buffer()
+            with nogil:
+                status = self.encoder.encode_as_ids_flat_uint16(s.batch, &ids16.data, &offsets.data, bos, eos, reverse, dropout_prob, seed)
+            if status.code != 0:
+                raise ValueError(status.message.decode())
+            return memoryview(ids16), memoryview(offsets)
+        else:
+            raise ValueError('dtype must be equal to "int32" or "uint16"')
+
+    def encode_fixed(self, sentences, max_len, truncate, out, bool bos, bool eos, bool reverse, double dropout_prob, dropout_seed=None, dtype="int32"):
+        cdef Sentences s
+        cdef IntBuffer matrix
+        cdef UInt16Buffer matrix16
+        cdef int[:, ::1] out_view
+        cdef uint16_t[:, ::1] out_view16
+        cdef int* data = NULL
+        cdef uint16_t* data16 = NULL
+        cdef UInt64Buffer lengths = UInt64Buffer()
+        cdef Status status
+        if max_len < 0:
+            raise ValueError("max_len must be non-negative. Current value of max_len = " + str(max_len))
+        if truncate != "left" and truncate != "right":
+            raise ValueError('truncate must be equal to "left" or "right"')
+        cdef uint64_t c_max_len = max_len
+        cdef bool truncate_left = truncate == "left"
+        if dropout_prob < 0 or dropout_prob > 1:
+            raise ValueError("dropout_prob value must be in the range [0, 1]. Current value of dropout_prob = " + str(dropout_prob))
+        cdef int64_t seed = dropout_seed_value(dropout_seed)
+        s = read_sentences(sentences)
+        lengths.data.resize(s.batch.size())
+        if dtype == "int32":
+            if out is None:
+                matrix = IntBuffer()
+                matrix.data.resize(s.batch.size() * max_len)
+                matrix.reshape(s.batch.size(), max_len)
+                out = memoryview(matrix)
+            out_view = out
+            if out_view.shape[0] != <Py_ssize_t>s.batch.size() or out_view.shape[1] != max_len:
+                raise ValueError("out must have shape (len(sentences), max_len)")
+            if out_view.size != 0:
+                data = &out_view[0, 0]
+            with nogil:
+                status = self.encoder.encode_as_ids_fixed(s.batch, c_max_len, truncate_left, data, lengths.data.data(), bos, eos, reverse, dropout_prob, seed)
+        elif dtype == "uint16":
+            if out is None:
+                matrix16 = UInt16Buffer()
+                matrix16.data.resize(s.batch.size() * max_len)
+                matrix16.reshape(s.batch.size(), max_len)
+                out = memoryview(matrix16)
+            out_view16 = out
+            if out_view16.shape[0] != <Py_ssize_t>s.batch.size() or out_view16.shape[1] != max_len:
+                raise ValueError("out must have shape (len(sentences), max_len)")
+            if out_view16.size != 0:
+                data16 = &out_view16[0, 0]
+            with nogil:
+                status = self.encoder.encode_as_ids_fixed_uint16(s.batch, c_max_len, truncate_left, data16, lengths.data.data(), bos, eos, reverse, dropout_prob, seed)
+        else:
+            raise ValueError('dtype must be equal to "int32" or "uint16"')
+        if status.code != 0:
+            raise ValueError(status.message.decode())
+        return out, memoryview(lengths)
+
+    def encode_samples(self, sentences, n_samples, bool bos, bool eos, bool reverse, double dropout_prob, dropout_seed=None):
+        cdef Sentences s
+        cdef IntBuffer ids = IntBuffer()
+        cdef UInt64Buffer offsets = UInt64Buffer()
+        cdef Status status
+        if n_samples < 1:
+            raise ValueError("n_samples must be positive. Current value of n_samples = " + str(n_samples))
+        cdef uint64_t c_n_samples = n_samples
+        if dropout_prob < 0 or dropout_prob > 1:
+            raise ValueError("dropout_prob value must be in the range [0, 1]. Current value of dropout_prob = " + str(dropout_prob))
+        cdef int64_t seed = dropout_seed_value(dropout_seed)
+        s = read_sentences(sentences)
+        with nogil:
+            status = self.encoder.encode_as_ids_samples(s.batch, c_n_samples, &ids.data, &offsets.data, bos, eos, reverse, dropout_prob, seed)
+        if status.code != 0:
+            raise ValueError(status.message.decode())
+        return memoryview(ids), memoryview(offsets)
+
+    def encode_padded(self, sentences, bool bos, bool eos, bool reverse, double dropout_prob, dropout_seed=None, dtype="int32"):
+        cdef Sentences s
+        cdef IntBuffer matrix
+        cdef UInt16Buffer matrix16
+        cdef UInt64Buffer lengths = UInt64Buffer()
+        cdef uint64_t max_len = 0
+        cdef Status status
+        if dropout_prob < 0 or dropout_prob > 1:
+            raise ValueError("dropout_prob value must be in the range [0, 1]. Current value of dropout_prob = " + str(dropout_prob))
+        cdef int64_t seed = dropout_seed_value(dropout_seed)
+        s = read_sentences(sentences)
+        if dtype == "int32":
+            matrix = IntBuffer()
+            with nogil:
+                status = self.encoder.encode_as_ids_padded(s.batch, &matrix.data, &lengths.data, &max_len, bos, eos, reverse, dropout_prob, seed)
+            if status.code != 0:
+                raise ValueError(status.message.decode())
+            matrix.reshape(s.batch.size(), max_len)
+            return memoryview(matrix), memoryview(lengths)
+        elif dtype == "uint16":
+            matrix16 = UInt16Buffer()
+            with nogil:
+                status = self.encoder.encode_as_ids_padded_uint16(s.batch, &matrix16.data, &lengths.data, &max_len, bos, eos, reverse, dropout_prob, seed)
+            if status.code != 0:
+                raise ValueError(status.message.decode())
+            matrix16.reshape(s.batch.size(), max_len)
+            return memoryview(matrix16), memoryview(lengths)
+        else:
+            raise ValueError('dtype must be equal to "int32" or "uint16"')
+
     def subword_to_id(self, subword):
         return self.encoder.subword_to_id(subword.encode())
 
@@ -150,9 +523,12 @@ cdef class BPE:
         if ignore_ids is None:
             ignore_ids = set()
 
+        cdef vector[vector[int]] c_ids = ids
         cdef vector[string] sentences
         cdef unordered_set[int] c_ignore_ids = unordered_set[int](ignore_ids)
-        cdef Status status = self.encoder.decode(ids, &sentences, &c_ignore_ids)
+        cdef Status status
+        with nogil:
+            status = self.encoder.decode(c_ids, &sentences, &c_ignore_ids)
         if status.code != 0:
             raise ValueError(status.message.decode())
         return [sentence.decode() for sentence in sentences]
@@ -164,8 +540,23 @@ cdef class BPE:
         cdef vector[string] vocab = self.encoder.vocabulary()
         return [token.decode() for token in vocab]
 
-    def encode_cli(self, output_type, stream, bos, eos, reverse, dropout_prob):
-        cdef Status status = self.encoder.encode_cli(output_type.encode(), stream, bos, eos, reverse, dropout_prob)
+    def cache_stats(self):
+        cdef CacheStats stats = self.encoder.cache_stats()
+        return {"hits": stats.hits, "misses": stats.misses, "entries": stats.entries, "memory": stats.memory}
+
+    def model_hash(self):
+        return self.encoder.model_hash()
+
+    def save_binary(self, path):
+        cdef Status status = self.encoder.dump_binary(path.encode())
+        if status.code != 0:
+            raise ValueError(status.message.decode())
+
+    def encode_cli(self, output_type, stream, bos, eos, reverse, dropout_prob, dropout_seed=None, input_path=None, output_path=None):
+        cdef int64_t seed = dropout_seed_value(dropout_seed)
+        cdef string c_input_path = input_path.encode() if input_path is not None else b""
+        cdef string c_output_path = output_path.encode() if output_path is not None else b""
+        cdef Status status = self.encoder.encode_cli(output_type.encode(), stream, bos, eos, reverse, dropout_prob, seed, c_input_path, c_output_path)
         if status.code != 0:
             raise ValueError(status.message.decode())
 
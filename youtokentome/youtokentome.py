@@ -1,6 +1,16 @@
 import _youtokentome_cython
+import mmap
+import os
+import struct
 from enum import Enum
-from typing import List, Union, Optional, Collection
+from typing import Dict, List, Union, Optional, Collection, Tuple
+
+PackedSentences = _youtokentome_cython.PackedSentences
+
+# A sentence is str or bytes, bytearray, memoryview or another contiguous
+# buffer of UTF-8 text.
+Sentence = Union[str, bytes, bytearray, memoryview]
+Sentences = Union[List[Sentence], Tuple[Sentence, ...], PackedSentences]
 
 
 class OutputType(Enum):
@@ -9,12 +19,13 @@ class OutputType(Enum):
 
 
 class BPE:
-    def __init__(self, model: str, n_threads: int = -1):
+    def __init__(self, model: str, n_threads: int = -1, cache_size: int = 0):
         self.model = model
         self.n_threads = n_threads
+        self.cache_size = cache_size
 
         self.bpe_cython = _youtokentome_cython.BPE(
-            model_path=model, n_threads=n_threads
+            model_path=model, n_threads=n_threads, cache_size=cache_size
         )
 
     @staticmethod
@@ -45,12 +56,13 @@ class BPE:
 
     def encode(
         self,
-        sentences: List[str],
+        sentences: Sentences,
         output_type: OutputType = OutputType.ID,
         bos: bool = False,
         eos: bool = False,
         reverse: bool = False,
         dropout_prob: float = 0,
+        dropout_seed: Optional[int] = None,
     ) -> Union[List[List[int]], List[List[str]]]:
         if not isinstance(output_type, OutputType):
             raise TypeError(
@@ -66,11 +78,117 @@ class BPE:
             eos=eos,
             reverse=reverse,
             dropout_prob=dropout_prob,
+            dropout_seed=dropout_seed,
+        )
+
+    def encode_flat(
+        self,
+        sentences: Sentences,
+        bos: bool = False,
+        eos: bool = False,
+        reverse: bool = False,
+        dropout_prob: float = 0,
+        dropout_seed: Optional[int] = None,
+    ) -> Tuple[memoryview, memoryview]:
+        return self.bpe_cython.encode_flat(
+            sentences=sentences,
+            bos=bos,
+            eos=eos,
+            reverse=reverse,
+            dropout_prob=dropout_prob,
+            dropout_seed=dropout_seed,
+        )
+
+    def encode_fixed(
+        self,
+        sentences: Sentences,
+        max_len: int,
+        truncate: str = "right",
+        out=None,
+        dtype: str = "int32",
+        bos: bool = False,
+        eos: bool = False,
+        reverse: bool = False,
+        dropout_prob: float = 0,
+        dropout_seed: Optional[int] = None,
+    ):
+        return self.bpe_cython.encode_fixed(
+            sentences=sentences,
+            max_len=max_len,
+            truncate=truncate,
+            out=out,
+            bos=bos,
+            eos=eos,
+            reverse=reverse,
+            dropout_prob=dropout_prob,
+            dropout_seed=dropout_seed,
+            dtype=dtype,
+        )
+
+    def encode_samples(
+        self,
+        sentences: Sentences,
+        n_samples: int,
+        dropout_prob: float,
+        bos: bool = False,
+        eos: bool = False,
+        reverse: bool = False,
+        dropout_seed: Optional[int] = None,
+    ) -> Tuple[memoryview, memoryview]:
+        return self.bpe_cython.encode_samples(
+            sentences=sentences,
+            n_samples=n_samples,
+            bos=bos,
+            eos=eos,
+            reverse=reverse,
+            dropout_prob=dropout_prob,
+            dropout_seed=dropout_seed,
+        )
+
+    def encode_numpy(
+        self,
+        sentences: Sentences,
+        padded: bool = False,
+        dtype: str = "int32",
+        bos: bool = False,
+        eos: bool = False,
+        reverse: bool = False,
+        dropout_prob: float = 0,
+        dropout_seed: Optional[int] = None,
+    ):
+        import numpy as np
+
+        if padded:
+            matrix, lengths = self.bpe_cython.encode_padded(
+                sentences=sentences,
+                bos=bos,
+                eos=eos,
+                reverse=reverse,
+                dropout_prob=dropout_prob,
+                dropout_seed=dropout_seed,
+                dtype=dtype,
+            )
+            return np.asarray(matrix), np.asarray(lengths)
+        ids, offsets = self.bpe_cython.encode_flat(
+            sentences=sentences,
+            bos=bos,
+            eos=eos,
+            reverse=reverse,
+            dropout_prob=dropout_prob,
+            dropout_seed=dropout_seed,
+            dtype=dtype,
         )
+        return np.asarray(ids), np.asarray(offsets)
 
     def vocab_size(self) -> int:
         return self.bpe_cython.vocab_size()
 
+    def model_hash(self) -> int:
+        return self.bpe_cython.model_hash()
+
+    def save_binary(self, path: str):
+        self.bpe_cython.save_binary(path)
+
     def vocab(self) -> List[str]:
         return self.bpe_cython.vocab()
 
@@ -80,6 +198,9 @@ class BPE:
     def id_to_subword(self, id: int) -> str:
         return self.bpe_cython.id_to_subword(id)
 
+    def cache_stats(self) -> Dict[str, int]:
+        return self.bpe_cython.cache_stats()
+
     def decode(
         self,
         ids: Union[List[int], List[List[int]]],
@@ -88,12 +209,105 @@ class BPE:
         return self.bpe_cython.decode(ids, ignore_ids)
 
     def __getstate__(self):
-        return {"model": self.model, "n_threads": self.n_threads}
+        return {
+            "model": self.model,
+            "n_threads": self.n_threads,
+            "cache_size": self.cache_size,
+        }
 
     def __setstate__(self, dict):
         self.model = dict["model"]
         self.n_threads = dict["n_threads"]
+        self.cache_size = dict.get("cache_size", 0)
 
         self.bpe_cython = _youtokentome_cython.BPE(
-            model_path=self.model, n_threads=self.n_threads
+            model_path=self.model, n_threads=self.n_threads, cache_size=self.cache_size
         )
+
+
+class Dataset:
+    """Memory-mapped reader of a binary dataset written by
+    `yttm encode --output_type binary --output PATH`.
+
+    dataset[i] is a memoryview of the ids of the i-th sentence. The ids are read
+    straight from the mapped file, so random access doesn't load the whole
+    dataset into memory.
+    """
+
+    _HEADER = struct.Struct("<8sIIQiiiiQ")
+    _MAGIC = b"YTTMDATA"
+    _VERSION = 1
+
+    def __init__(self, path: str):
+        self.path = path
+        self._data_map = None
+        self._index_map = None
+
+        with open(path + ".idx", "rb") as f:
+            self._index_map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        if len(self._index_map) < self._HEADER.size:
+            raise ValueError("%s is not a youtokentome dataset" % path)
+        (
+            magic,
+            version,
+            self.id_size,
+            self.model_hash,
+            self.pad_id,
+            self.unk_id,
+            self.bos_id,
+            self.eos_id,
+            n_sentences,
+        ) = self._HEADER.unpack_from(self._index_map)
+        if magic != self._MAGIC:
+            raise ValueError("%s is not a youtokentome dataset" % path)
+        if version != self._VERSION or self.id_size not in (2, 4):
+            raise ValueError("Unsupported dataset version: %d" % version)
+        if len(self._index_map) != self._HEADER.size + 8 * (n_sentences + 1):
+            raise ValueError("Index of dataset %s is corrupted" % path)
+        self._offsets = memoryview(self._index_map)[self._HEADER.size :].cast("Q")
+
+        id_format = "H" if self.id_size == 2 else "I"
+        with open(path, "rb") as f:
+            data_size = os.fstat(f.fileno()).st_size
+            if data_size != self._offsets[-1] * self.id_size:
+                raise ValueError("Dataset %s is corrupted" % path)
+            if data_size > 0:
+                self._data_map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+                self._ids = memoryview(self._data_map).cast(id_format)
+            else:
+                self._ids = memoryview(b"").cast(id_format)
+
+    def __len__(self) -> int:
+        return len(self._offsets) - 1
+
+    def __getitem__(self, i: int) -> memoryview:
+        n_sentences = len(self)
+        if i < 0:
+            i += n_sentences
+        if not 0 <= i < n_sentences:
+            raise IndexError("sentence index out of range")
+        return self._ids[self._offsets[i] : self._offsets[i + 1]]
+
+    @property
+    def ids(self) -> memoryview:
+        """Ids of all sentences one after another."""
+        return self._ids
+
+    @property
+    def offsets(self) -> memoryview:
+        """Ids of sentence i are ids[offsets[i]:offsets[i + 1]]."""
+        return self._offsets
+
+    def close(self):
+        """Unmaps the files. Views returned by the dataset must be released before."""
+        self._ids.release()
+        self._offsets.release()
+        if self._data_map is not None:
+            self._data_map.close()
+        self._index_map.close()
+
+    def __enter__(self) -> "Dataset":
+        return self
+
+    def __exit__(self, *args):
+        self.close()
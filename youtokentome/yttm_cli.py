@@ -81,9 +81,10 @@ def bpe(data, model, vocab_size, coverage, n_threads, pad_id, unk_id, bos_id, eo
 )
 @click.option(
     "--output_type",
-    type=click.Choice(["id", "subword"]),
+    type=click.Choice(["id", "subword", "binary"]),
     required=True,
-    help="'id' or 'subword'.",
+    help="'id', 'subword' or 'binary'. Binary output is a dataset of packed ids "
+    "written to --output.",
 )
 @click.option(
     "--n_threads",
@@ -105,17 +106,69 @@ def bpe(data, model, vocab_size, coverage, n_threads, pad_id, unk_id, bos_id, eo
     show_default=True,
     help="BPE-dropout probability (the probability of a merge being dropped)",
 )
-def encode(model, output_type, n_threads, bos, eos, reverse, stream, dropout_prob):
+@click.option(
+    "--dropout_seed",
+    type=click.IntRange(min=0),
+    default=None,
+    help="Seed of BPE-dropout. By default the seed is random.",
+)
+@click.option(
+    "--input",
+    "input_path",
+    type=click.Path(exists=True, dir_okay=False),
+    default=None,
+    help="Path to file with text to encode. By default stdin is used. "
+    "The file is mapped into memory and encoded by all threads.",
+)
+@click.option(
+    "--output",
+    "output_path",
+    type=click.Path(dir_okay=False),
+    default=None,
+    help="Path to output file. By default stdout is used. Required for binary "
+    "output: ids are written to this file and their offsets to OUTPUT.idx.",
+)
+def encode(
+    model,
+    output_type,
+    n_threads,
+    bos,
+    eos,
+    reverse,
+    stream,
+    dropout_prob,
+    dropout_seed,
+    input_path,
+    output_path,
+):
     """Encode text to ids or subwords."""
+    check_n_threads(n_threads)
+    if output_type == "binary" and output_path is None:
+        raise ValueError('"--output_type binary" requires "--output"')
+    if stream and (input_path is not None or output_path is not None):
+        raise ValueError('"--stream" can\'t be used with "--input" or "--output"')
+
+    bpe = yttmc.BPE(model, n_threads)
+    bpe.encode_cli(
+        output_type,
+        stream,
+        bos,
+        eos,
+        reverse,
+        dropout_prob,
+        dropout_seed,
+        input_path,
+        output_path,
+    )
+
+
+def check_n_threads(n_threads):
     if n_threads < -1 or n_threads == 0:
         raise ValueError(
             'Invalid value for "--n_threads": must be -1 or positive integer, not "%d"'
             % n_threads
         )
 
-    bpe = yttmc.BPE(model, n_threads)
-    bpe.encode_cli(output_type, stream, bos, eos, reverse, dropout_prob)
-
 
 def validate_ignore_ids(ctx, param, value):
     try:
@@ -143,9 +196,17 @@ def validate_ignore_ids(ctx, param, value):
     required=False,
     help="List of indices to ignore for decoding. Example: --ignore_ids=1,2,3",
 )
-def decode(model, ignore_ids):
+@click.option(
+    "--n_threads",
+    type=click.INT,
+    help="Number of threads.",
+    default=-1,
+    show_default=True,
+)
+def decode(model, ignore_ids, n_threads):
     """Decode ids to text."""
-    bpe = yttmc.BPE(model)
+    check_n_threads(n_threads)
+    bpe = yttmc.BPE(model, n_threads)
     bpe.decode_cli(ignore_ids)
 
 
@@ -163,7 +224,27 @@ def vocab(model, verbose):
     bpe.vocab_cli(verbose)
 
 
+@click.command()
+@click.option(
+    "--model",
+    type=click.Path(exists=True),
+    required=True,
+    help="Path to file with learned model.",
+)
+@click.option(
+    "--output",
+    type=click.Path(dir_okay=False),
+    required=True,
+    help="Path to the binary model.",
+)
+def convert(model, output):
+    """Convert model to the binary format."""
+    bpe = yttmc.BPE(model, 1)
+    bpe.save_binary(output)
+
+
 main.add_command(bpe)
 main.add_command(encode)
 main.add_command(decode)
 main.add_command(vocab)
+main.add_command(convert)